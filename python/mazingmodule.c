@@ -1,22 +1,384 @@
+/* mazingmodule.c - Python interface to the mazing library
+
+The expensive calls are made with the GIL released, so several Python
+threads can count or unrank mazes at the same time. Integers are passed
+to and from GMP as little-endian bytes, never as decimal strings.
+*/
+
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include <gmp.h>
 
+#include "mazing.h"
+#include "fmc.h"
+
+
+/** Converting integers **/
+
+/* Set 'out' to the value of the Python int 'obj'.
+Returns 0 on success, or -1 with an exception set. */
+static int
+mpz_from_pylong(mpz_t out, PyObject *obj)
+{
+    int overflow;
+    long long small;
+    PyObject *bits_obj, *bytes;
+    Py_ssize_t bits, num_bytes;
+
+    if (!PyLong_Check(obj)) {
+        PyErr_SetString(PyExc_TypeError, "an int is required");
+        return -1;
+    }
+
+    small = PyLong_AsLongLongAndOverflow(obj, &overflow);
+    if (small == -1 && PyErr_Occurred())
+        return -1;
+    if (overflow < 0 || (!overflow && small < 0)) {
+        PyErr_SetString(PyExc_ValueError, "index must not be negative");
+        return -1;
+    }
+    if (!overflow) {
+        unsigned long long magnitude = small;
+        mpz_import(out, 1, -1, sizeof magnitude, 0, 0, &magnitude);
+        return 0;
+    }
+
+    bits_obj = PyObject_CallMethod(obj, "bit_length", NULL);
+    if (!bits_obj)
+        return -1;
+    bits = PyLong_AsSsize_t(bits_obj);
+    Py_DECREF(bits_obj);
+    if (bits < 0)
+        return -1;
+
+    num_bytes = (bits + 7) / 8;
+    bytes = PyObject_CallMethod(obj, "to_bytes", "ns", num_bytes, "little");
+    if (!bytes)
+        return -1;
+    mpz_import(out, num_bytes, -1, 1, 0, 0, PyBytes_AS_STRING(bytes));
+    Py_DECREF(bytes);
+    return 0;
+}
+
+/* A new Python int with the (non-negative) value of 'x' */
+static PyObject *
+pylong_from_mpz(mpz_t x)
+{
+    size_t num_bytes;
+    char *buf;
+    PyObject *result;
+
+    if (mpz_fits_slong_p(x))
+        return PyLong_FromLong(mpz_get_si(x));
+
+    num_bytes = (mpz_sizeinbase(x, 2) + 7) / 8;
+    buf = PyMem_Malloc(num_bytes);
+    if (!buf)
+        return PyErr_NoMemory();
+    mpz_export(buf, &num_bytes, -1, 1, 0, 0, x);
+
+    result = PyObject_CallMethod((PyObject *) &PyLong_Type, "from_bytes", "y#s",
+                                 buf, (Py_ssize_t) num_bytes, "little");
+    PyMem_Free(buf);
+    return result;
+}
+
+/* Check the grid size passed in from Python */
+static int
+check_size(int width, int height)
+{
+    if (width <= 0 || height <= 0) {
+        PyErr_SetString(PyExc_ValueError, "width and height must be positive");
+        return -1;
+    }
+    return 0;
+}
+
+
+/** The Maze type **
+
+A Maze owns a maze_t, and exposes its 'conn' array through the
+buffer protocol as a read-only (height, width) array of bytes,
+so that e.g. numpy.asarray(maze) or memoryview(maze) do not copy it.
+*/
+
+typedef struct {
+    PyObject_HEAD
+    maze_t *maze;
+    Py_ssize_t shape[2];
+    Py_ssize_t strides[2];
+} MazeObject;
+
+static PyTypeObject MazeType;
+
+/* Wrap 'maze', taking ownership of it */
+static PyObject *
+Maze_wrap(maze_t *maze)
+{
+    MazeObject *self = PyObject_New(MazeObject, &MazeType);
+    if (!self) {
+        maze_free(maze);
+        return NULL;
+    }
+
+    self->maze = maze;
+    self->shape[0] = maze->height;
+    self->shape[1] = maze->width;
+    self->strides[0] = maze->width;
+    self->strides[1] = 1;
+    return (PyObject *) self;
+}
+
+static void
+Maze_dealloc(MazeObject *self)
+{
+    maze_free(self->maze);
+    PyObject_Del(self);
+}
+
+static int
+Maze_getbuffer(MazeObject *self, Py_buffer *view, int flags)
+{
+    if (PyBuffer_FillInfo(view, (PyObject *) self, self->maze->conn,
+                          self->shape[0] * self->shape[1], 1, flags) < 0)
+        return -1;
+
+    if ((flags & PyBUF_ND) == PyBUF_ND) {
+        view->ndim = 2;
+        view->shape = self->shape;
+    }
+    if ((flags & PyBUF_STRIDES) == PyBUF_STRIDES)
+        view->strides = self->strides;
+    return 0;
+}
+
+static PyBufferProcs Maze_as_buffer = {
+    (getbufferproc) Maze_getbuffer,
+    NULL,
+};
+
+static PyObject *
+Maze_str(MazeObject *self)
+{
+    char *text = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&text, &len);
+    PyObject *result;
+
+    if (!f)
+        return PyErr_SetFromErrno(PyExc_OSError);
+    maze_fprint(f, self->maze);
+    fclose(f);
+
+    result = PyUnicode_FromStringAndSize(text, len);
+    free(text);
+    return result;
+}
+
+static PyObject *
+Maze_repr(MazeObject *self)
+{
+    return PyUnicode_FromFormat("<mazing.Maze %dx%d>", self->maze->width, self->maze->height);
+}
+
 static PyObject *
-maze_by_index(PyObject *self, PyObject *args)
+Maze_get_width(MazeObject *self, void *closure)
 {
+    return PyLong_FromLong(self->maze->width);
+}
+
+static PyObject *
+Maze_get_height(MazeObject *self, void *closure)
+{
+    return PyLong_FromLong(self->maze->height);
+}
+
+static PyGetSetDef Maze_getset[] = {
+    {"width", (getter) Maze_get_width, NULL, "Number of cells across", NULL},
+    {"height", (getter) Maze_get_height, NULL, "Number of cells down", NULL},
+    {NULL}
+};
+
+static PyTypeObject MazeType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "mazing.Maze",
+    .tp_basicsize = sizeof(MazeObject),
+    .tp_dealloc = (destructor) Maze_dealloc,
+    .tp_repr = (reprfunc) Maze_repr,
+    .tp_str = (reprfunc) Maze_str,
+    .tp_as_buffer = &Maze_as_buffer,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "A maze. Each byte of its buffer is a cell, with the bits\n"
+              "N, E, S and W set for the directions in which it is open.",
+    .tp_getset = Maze_getset,
+};
+
+
+/** Module functions **/
+
+static PyObject *
+mazing_fmc(PyObject *self, PyObject *args)
+{
+    int width, height;
+    mpz_t count;
+    PyObject *result;
+
+    if (!PyArg_ParseTuple(args, "ii", &width, &height) || check_size(width, height) < 0)
+        return NULL;
+
+    mpz_init(count);
+    Py_BEGIN_ALLOW_THREADS
+    fmc(&count, width, height);
+    Py_END_ALLOW_THREADS
+
+    result = pylong_from_mpz(count);
+    mpz_clear(count);
+    return result;
+}
+
+static PyObject *
+mazing_maze_by_index(PyObject *self, PyObject *args)
+{
+    int width, height;
     PyObject *index_obj;
-    if (!PyArg_ParseTuple(args, "O!", PyLong_Type, &index_obj))
+    mpz_t index;
+    maze_t *maze;
+
+    if (!PyArg_ParseTuple(args, "iiO", &width, &height, &index_obj) || check_size(width, height) < 0)
         return NULL;
-    return index_obj;
+
+    mpz_init(index);
+    if (mpz_from_pylong(index, index_obj) < 0) {
+        mpz_clear(index);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    maze = maze_by_index(width, height, index);
+    Py_END_ALLOW_THREADS
+
+    mpz_clear(index);
+    if (!maze) {
+        PyErr_SetString(PyExc_ValueError, "index out of range");
+        return NULL;
+    }
+    return Maze_wrap(maze);
+}
+
+static PyObject *
+mazing_mazes_by_index(PyObject *self, PyObject *args)
+{
+    int width, height;
+    PyObject *indices_obj, *seq, *result = NULL;
+    Py_ssize_t n, i, bad = -1;
+    mpz_t *indices;
+    maze_t **mazes;
+
+    if (!PyArg_ParseTuple(args, "iiO", &width, &height, &indices_obj) || check_size(width, height) < 0)
+        return NULL;
+
+    seq = PySequence_Fast(indices_obj, "indices must be iterable");
+    if (!seq)
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(seq);
+
+    indices = PyMem_Calloc(n ? n : 1, sizeof(mpz_t));
+    mazes = PyMem_Calloc(n ? n : 1, sizeof(maze_t *));
+    if (!indices || !mazes) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    for (i = 0; i < n; i++) {
+        mpz_init(indices[i]);
+        if (mpz_from_pylong(indices[i], PySequence_Fast_GET_ITEM(seq, i)) < 0) {
+            n = i + 1;
+            goto done;
+        }
+        mazes[i] = maze_init(width, height);
+    }
+
+    /* One prepared context does for the whole batch */
+    Py_BEGIN_ALLOW_THREADS
+    maze_ctx_t *ctx = maze_ctx_new(width, height);
+    for (i = 0; i < n && bad < 0; i++)
+        if (maze_ctx_unrank(ctx, indices[i], mazes[i]) != MAZE_OK)
+            bad = i;
+    maze_ctx_free(ctx);
+    Py_END_ALLOW_THREADS
+
+    if (bad >= 0) {
+        PyErr_Format(PyExc_ValueError, "index %zd out of range", bad);
+        goto done;
+    }
+
+    result = PyList_New(n);
+    if (!result)
+        goto done;
+    for (i = 0; i < n; i++) {
+        PyObject *maze = Maze_wrap(mazes[i]);
+        mazes[i] = NULL;
+        if (!maze) {
+            Py_CLEAR(result);
+            goto done;
+        }
+        PyList_SET_ITEM(result, i, maze);
+    }
+
+done:
+    if (indices && mazes)
+        for (i = 0; i < n; i++) {
+            mpz_clear(indices[i]);
+            if (mazes[i]) maze_free(mazes[i]);
+        }
+    PyMem_Free(indices);
+    PyMem_Free(mazes);
+    Py_DECREF(seq);
+    return result;
 }
 
 static PyMethodDef MazingMethods[] = {
-    {"maze_by_index", maze_by_index, METH_VARARGS, "Find a maze by index."},
+    {"fmc", mazing_fmc, METH_VARARGS,
+     "fmc(width, height) -> int\n\nCount the mazes on a width x height grid."},
+    {"maze_by_index", mazing_maze_by_index, METH_VARARGS,
+     "maze_by_index(width, height, index) -> Maze\n\nFind a maze by index."},
+    {"mazes_by_index", mazing_mazes_by_index, METH_VARARGS,
+     "mazes_by_index(width, height, indices) -> list of Maze\n\n"
+     "Find several mazes of the same size by index, which is quicker\n"
+     "than calling maze_by_index for each of them."},
     {NULL, NULL, 0, NULL}
 };
 
+static struct PyModuleDef mazingmodule = {
+    PyModuleDef_HEAD_INIT,
+    "mazing",
+    "Random access to rectangular mazes.",
+    -1,
+    MazingMethods
+};
+
 PyMODINIT_FUNC
-initmazing(void)
+PyInit_mazing(void)
 {
-    (void) Py_InitModule("mazing", MazingMethods);
+    PyObject *m;
+
+    if (PyType_Ready(&MazeType) < 0)
+        return NULL;
+
+    m = PyModule_Create(&mazingmodule);
+    if (!m)
+        return NULL;
+
+    Py_INCREF(&MazeType);
+    if (PyModule_AddObject(m, "Maze", (PyObject *) &MazeType) < 0
+        || PyModule_AddIntConstant(m, "N", DIR_N) < 0
+        || PyModule_AddIntConstant(m, "E", DIR_E) < 0
+        || PyModule_AddIntConstant(m, "S", DIR_S) < 0
+        || PyModule_AddIntConstant(m, "W", DIR_W) < 0) {
+        Py_DECREF(&MazeType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    return m;
 }
@@ -1,10 +1,13 @@
-#!/usr/bin/env python
+#!/usr/bin/env python3
 
-from distutils.core import setup, Extension
+try:
+  from setuptools import setup, Extension
+except ImportError:
+  from distutils.core import setup, Extension
 
 setup(
   name = 'mazing',
-  version = '1',
+  version = '2',
   author = 'Robin Houston',
   author_email = 'robin@boskent.com',
   url = 'http://github.com/robinhouston/mazing',
@@ -12,12 +15,14 @@ setup(
   ext_modules = [Extension(
     "mazing",
     sources = ["mazingmodule.c"],
-    libraries = ["gmp", "mazing"],
+    include_dirs = ["../src"],
+    libraries = ["mazing", "gmp"],
   )],
+  python_requires = '>=3.3',
   classifiers = [
     "Development Status :: 4 - Beta",
     "License :: OSI Approved :: BSD License",
-    "Programming Language :: Python",
+    "Programming Language :: Python :: 3",
     "Programming Language :: C",
   ],
 )
@@ -0,0 +1,198 @@
+/* batch.c - Parallel batch unranking for the command-line tool */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <sysexits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <gmp.h>
+
+#include "mazing.h"
+#include "stats.h"
+#include "batch.h"
+
+
+/** Reading the input **/
+
+/* Read one index per line from 'in', ignoring blank lines.
+Returns the number of indices read, and stores a newly-allocated
+array of them in *indices_out, or returns -1 on a malformed line. */
+static int read_indices(FILE *in, mpz_t **indices_out)
+{
+    int n = 0, capacity = 1024, line_number = 0;
+    mpz_t *indices = malloc(sizeof(mpz_t) * capacity);
+    char *line = 0;
+    size_t line_capacity = 0;
+
+    while (getline(&line, &line_capacity, in) >= 0)
+    {
+        char *start = line, *end = line + strlen(line);
+        line_number++;
+
+        while (isspace((unsigned char) *start)) start++;
+        while (end > start && isspace((unsigned char) end[-1])) end--;
+        if (start == end) continue;
+        *end = '\0';
+
+        if (n == capacity)
+        {
+            capacity *= 2;
+            indices = realloc(indices, sizeof(mpz_t) * capacity);
+        }
+
+        if (mpz_init_set_str(indices[n++], start, 10) != 0)
+        {
+            fprintf(stderr, "Line %d: not a valid index: %s\n", line_number, start);
+            for (int i = 0; i < n; i++)
+                mpz_clear(indices[i]);
+            free(indices);
+            free(line);
+            return -1;
+        }
+    }
+
+    free(line);
+    *indices_out = indices;
+    return n;
+}
+
+
+/** The worker pool **
+
+The items are independent and all take roughly the same time,
+so rather than giving each thread its own deque to steal from,
+the workers simply claim the next unclaimed item from a shared
+counter. The main thread writes out each result as soon as it
+and all the results before it are ready.
+*/
+
+typedef struct {
+    int width, height;
+    int num_items;
+    mpz_t *indices;
+    maze_t **mazes;  /* result, or NULL if the index was out of range */
+    bool *done;      /* done[i] is set once mazes[i] has been filled in */
+    int next;        /* the next item that no worker has claimed yet */
+    mazing_stats_t *stats;
+    pthread_mutex_t lock;
+    pthread_cond_t item_done;
+} batch_t;
+
+static void *batch_worker(void *arg)
+{
+    batch_t *b = arg;
+    mazing_stats_t stats;
+
+    mazing_stats_reset();
+    maze_ctx_t *ctx = maze_ctx_new(b->width, b->height);
+
+    for (;;)
+    {
+        pthread_mutex_lock(&b->lock);
+        int i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+
+        if (i >= b->num_items)
+            break;
+
+        maze_t *maze = maze_init(b->width, b->height);
+        if (maze_ctx_unrank(ctx, b->indices[i], maze) != MAZE_OK)
+        {
+            maze_free(maze);
+            maze = 0;
+        }
+
+        pthread_mutex_lock(&b->lock);
+        b->mazes[i] = maze;
+        b->done[i] = true;
+        pthread_cond_signal(&b->item_done);
+        pthread_mutex_unlock(&b->lock);
+    }
+
+    maze_ctx_free(ctx);
+
+    if (b->stats)
+    {
+        mazing_stats_get(&stats);
+        pthread_mutex_lock(&b->lock);
+        mazing_stats_add(b->stats, &stats);
+        pthread_mutex_unlock(&b->lock);
+    }
+    mazing_stats_reset();
+
+    return 0;
+}
+
+int batch_default_threads(void)
+{
+    char *env = getenv("MAZING_THREADS");
+    if (env && atoi(env) > 0)
+        return atoi(env);
+
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int) n : 1;
+}
+
+int batch_run(int width, int height, FILE *in, FILE *out, int num_threads,
+    mazing_stats_t *stats)
+{
+    batch_t b;
+    int status = 0;
+
+    b.num_items = read_indices(in, &b.indices);
+    if (b.num_items < 0)
+        return EX_DATAERR;
+
+    b.width = width;
+    b.height = height;
+    b.mazes = malloc(sizeof(maze_t *) * b.num_items);
+    b.done = calloc(b.num_items, sizeof(bool));
+    b.next = 0;
+    b.stats = stats;
+    pthread_mutex_init(&b.lock, 0);
+    pthread_cond_init(&b.item_done, 0);
+
+    if (num_threads > b.num_items) num_threads = b.num_items;
+    if (num_threads < 1) num_threads = 1;
+    pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+    for (int t = 0; t < num_threads; t++)
+        pthread_create(&threads[t], 0, batch_worker, &b);
+
+    for (int i = 0; i < b.num_items; i++)
+    {
+        pthread_mutex_lock(&b.lock);
+        while (!b.done[i])
+            pthread_cond_wait(&b.item_done, &b.lock);
+        pthread_mutex_unlock(&b.lock);
+
+        if (b.mazes[i])
+        {
+            maze_fprint(out, b.mazes[i]);
+            maze_free(b.mazes[i]);
+        }
+        else
+        {
+            gmp_fprintf(stderr, "Index number out of range: %Zd\n", b.indices[i]);
+            status = EX_DATAERR;
+        }
+    }
+
+    for (int t = 0; t < num_threads; t++)
+        pthread_join(threads[t], 0);
+    free(threads);
+
+    pthread_cond_destroy(&b.item_done);
+    pthread_mutex_destroy(&b.lock);
+    for (int i = 0; i < b.num_items; i++)
+        mpz_clear(b.indices[i]);
+    free(b.indices);
+    free(b.mazes);
+    free(b.done);
+
+    return status;
+}
@@ -0,0 +1,13 @@
+/* Unrank a whole batch of indices, one per line of 'in', using
+'num_threads' worker threads, and print the mazes to 'out' in the
+same order as their indices appeared in the input.
+
+If 'stats' is not NULL, the workers' counters (see stats.h) are
+added to it when they finish.
+
+Returns 0 on success, or a sysexits.h code if something went wrong. */
+int batch_run(int width, int height, FILE *in, FILE *out, int num_threads,
+    mazing_stats_t *stats);
+
+/* A sensible default for the number of worker threads */
+int batch_default_threads(void);
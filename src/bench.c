@@ -0,0 +1,339 @@
+/* bench.c - Benchmarks for fmc, maze_by_index and maze_print
+
+Times each operation over a range of grid shapes, and writes the
+results as JSON so that two builds can be compared. Run it with
+--help to see the options.
+
+Each shape is run in a child process of its own, so that the peak RSS
+reported for it is its own, and not the largest of any shape before it.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE     /* For wait4 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <gmp.h>
+
+#include "mazing.h"
+#include "fmc.h"
+#include "timing.h"
+
+
+/** Options **/
+
+typedef struct {
+    int warmup;      /* Untimed runs before the timed ones */
+    int reps;        /* Timed runs for each operation and shape */
+    int max_fmc;     /* Largest dimension to count mazes for */
+    int max_unrank;  /* Largest dimension to unrank and print mazes for */
+    char *out_path;  /* Where to write the JSON, or NULL for stdout */
+} options_t;
+
+static void usage(char *argv0)
+{
+    fprintf(stderr, "Usage: %s [--warmup N] [--reps N] [--max-fmc N] [--max-unrank N] [--out file]\n", argv0);
+}
+
+static int parse_options(int argc, char **argv, options_t *opt)
+{
+    opt->warmup = 1;
+    opt->reps = 9;
+    opt->max_fmc = 96;
+    opt->max_unrank = 16;
+    opt->out_path = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && strcmp(argv[i], "--warmup") == 0)
+            opt->warmup = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--reps") == 0)
+            opt->reps = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--max-fmc") == 0)
+            opt->max_fmc = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--max-unrank") == 0)
+            opt->max_unrank = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--out") == 0)
+            opt->out_path = argv[++i];
+        else
+            return -1;
+    }
+
+    if (opt->warmup < 0 || opt->reps < 1)
+        return -1;
+    return 0;
+}
+
+
+/** Grid shapes **
+
+Square grids, and wide and tall ones with an aspect ratio of 4,
+for a roughly geometric sequence of sizes.
+*/
+
+static const int sizes[] = { 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512 };
+#define NUM_SIZES ((int) (sizeof sizes / sizeof sizes[0]))
+
+typedef struct {
+    const char *name;
+    int width, height;
+} shape_t;
+
+/* Fill in the shapes whose larger dimension is at most 'max_dim',
+and return how many there are */
+static int make_shapes(shape_t *shapes, int max_dim)
+{
+    int n = 0;
+    for (int i = 0; i < NUM_SIZES && sizes[i] <= max_dim; i++)
+    {
+        int s = sizes[i], t = s / 4 < 2 ? 2 : s / 4;
+        shapes[n++] = (shape_t) { "square", s, s };
+        if (s >= 8)
+        {
+            shapes[n++] = (shape_t) { "wide", s, t };
+            shapes[n++] = (shape_t) { "tall", t, s };
+        }
+    }
+    return n;
+}
+
+
+/** Timing **/
+
+typedef struct {
+    const char *op;
+    shape_t shape;
+    double *times;
+    int reps;
+    size_t limbs;
+    long peak_rss_kb;
+} result_t;
+
+static void write_result(FILE *out, result_t *r, int first)
+{
+    double *t = r->times;
+    mazing_timing_sort(t, r->reps);
+    double median = mazing_timing_quantile(t, r->reps, 0.5), p99 = mazing_timing_quantile(t, r->reps, 0.99);
+
+    fprintf(out, "%s\n    {\"op\": \"%s\", \"shape\": \"%s\", \"width\": %d, \"height\": %d, "
+                 "\"reps\": %d, \"median_s\": %.9g, \"p99_s\": %.9g, \"min_s\": %.9g, \"max_s\": %.9g, "
+                 "\"peak_rss_kb\": %ld, \"limbs\": %zu}",
+        first ? "" : ",", r->op, r->shape.name, r->shape.width, r->shape.height,
+        r->reps, median, p99, t[0], t[r->reps - 1],
+        r->peak_rss_kb, r->limbs);
+
+    fprintf(stderr, "%-14s %-6s %4dx%-4d  median %10.6fs  p99 %10.6fs  %6zu limbs  rss %ld KB\n",
+        r->op, r->shape.name, r->shape.width, r->shape.height,
+        median, p99, r->limbs, r->peak_rss_kb);
+}
+
+
+/** The benchmarks **/
+
+static void bench_fmc(result_t *r, options_t *opt)
+{
+    mpz_t count;
+    mpz_init(count);
+
+    for (int i = 0; i < opt->warmup + opt->reps; i++)
+    {
+        double start = mazing_timing_now();
+        fmc(&count, r->shape.width, r->shape.height);
+        if (i >= opt->warmup)
+            r->times[i - opt->warmup] = mazing_timing_now() - start;
+    }
+
+    r->limbs = mpz_size(count);
+    mpz_clear(count);
+}
+
+/* Unrank, and then print to 'sink', a random maze for each run.
+The times for the two go in 'unrank' and 'print'. */
+static void bench_unrank(result_t *unrank, result_t *print, options_t *opt,
+    gmp_randstate_t rand, FILE *sink)
+{
+    int w = unrank->shape.width, h = unrank->shape.height;
+    mpz_t count, index;
+    mpz_init(count);
+    mpz_init(index);
+    fmc(&count, w, h);
+
+    for (int i = 0; i < opt->warmup + opt->reps; i++)
+    {
+        mpz_urandomm(index, rand, count);
+
+        double start = mazing_timing_now();
+        maze_t *maze = maze_by_index(w, h, index);
+        double mid = mazing_timing_now();
+        maze_fprint(sink, maze);
+        fflush(sink);
+        double end = mazing_timing_now();
+
+        if (i >= opt->warmup)
+        {
+            unrank->times[i - opt->warmup] = mid - start;
+            print->times[i - opt->warmup] = end - mid;
+        }
+        maze_free(maze);
+    }
+
+    unrank->limbs = print->limbs = mpz_size(count);
+    mpz_clear(count);
+    mpz_clear(index);
+}
+
+
+/** Running each shape in a process of its own **/
+
+static int write_all(int fd, const void *buf, size_t n)
+{
+    for (const char *p = buf; n > 0; )
+    {
+        ssize_t k = write(fd, p, n);
+        if (k <= 0)
+            return -1;
+        p += k;
+        n -= k;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t n)
+{
+    for (char *p = buf; n > 0; )
+    {
+        ssize_t k = read(fd, p, n);
+        if (k <= 0)
+            return -1;
+        p += k;
+        n -= k;
+    }
+    return 0;
+}
+
+/* Run bench_fmc for 'r' or, if 'print' isn't NULL, bench_unrank for 'r'
+and 'print', in a child process, which sends the times back through a
+pipe. The peak RSS comes from wait4. Returns 0 on success. */
+static int run_case(result_t *r, result_t *print, options_t *opt, FILE *sink)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        close(fds[0]);
+        if (print)
+        {
+            /* Every shape gets the same sequence of random numbers */
+            gmp_randstate_t rand;
+            gmp_randinit_default(rand);
+            gmp_randseed_ui(rand, 1);
+            bench_unrank(r, print, opt, rand, sink);
+            gmp_randclear(rand);
+        }
+        else
+            bench_fmc(r, opt);
+
+        int ok = write_all(fds[1], &r->limbs, sizeof r->limbs) == 0
+            && write_all(fds[1], r->times, sizeof(double) * r->reps) == 0
+            && (!print || write_all(fds[1], print->times, sizeof(double) * print->reps) == 0);
+        _exit(ok ? 0 : 1);
+    }
+
+    close(fds[1]);
+    int ok = read_all(fds[0], &r->limbs, sizeof r->limbs) == 0
+        && read_all(fds[0], r->times, sizeof(double) * r->reps) == 0
+        && (!print || read_all(fds[0], print->times, sizeof(double) * print->reps) == 0);
+    close(fds[0]);
+
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || !ok)
+        return -1;
+
+    r->peak_rss_kb = ru.ru_maxrss;
+    if (print)
+    {
+        print->limbs = r->limbs;
+        print->peak_rss_kb = ru.ru_maxrss;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    options_t opt;
+    shape_t shapes[3 * NUM_SIZES];
+
+    if (parse_options(argc, argv, &opt) != 0)
+    {
+        usage(argv[0]);
+        return EX_USAGE;
+    }
+
+    FILE *out = opt.out_path ? fopen(opt.out_path, "w") : stdout;
+    FILE *sink = fopen("/dev/null", "w");
+    if (!out || !sink)
+    {
+        perror(opt.out_path ? opt.out_path : "/dev/null");
+        return EX_CANTCREAT;
+    }
+
+    result_t r, p;
+    r.reps = p.reps = opt.reps;
+    r.times = malloc(sizeof(double) * opt.reps);
+    p.times = malloc(sizeof(double) * opt.reps);
+
+    fprintf(out, "{\n  \"version\": 1,\n  \"gmp_version\": \"%s\",\n"
+                 "  \"warmup\": %d,\n  \"reps\": %d,\n  \"results\": [",
+        gmp_version, opt.warmup, opt.reps);
+    int first = 1, failed = 0;
+
+    int n = make_shapes(shapes, opt.max_fmc);
+    for (int i = 0; i < n && !failed; i++)
+    {
+        r.op = "fmc";
+        r.shape = shapes[i];
+        if ((failed = run_case(&r, 0, &opt, sink) != 0))
+            break;
+        write_result(out, &r, first);
+        first = 0;
+    }
+
+    n = make_shapes(shapes, opt.max_unrank);
+    for (int i = 0; i < n && !failed; i++)
+    {
+        r.op = "maze_by_index";
+        p.op = "maze_print";
+        r.shape = p.shape = shapes[i];
+        if ((failed = run_case(&r, &p, &opt, sink) != 0))
+            break;
+        write_result(out, &r, first);
+        write_result(out, &p, 0);
+        first = 0;
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+    if (failed)
+        fprintf(stderr, "%s %dx%d failed\n", r.op, r.shape.width, r.shape.height);
+
+    free(r.times);
+    free(p.times);
+    fclose(sink);
+    if (out != stdout) fclose(out);
+    return failed ? EX_SOFTWARE : 0;
+}
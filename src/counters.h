@@ -0,0 +1,27 @@
+/* counters.h - Macros for updating the counters described in stats.h
+
+When MAZING_STATS is not defined they all expand to nothing. */
+
+#ifdef MAZING_STATS
+
+extern __thread mazing_stats_t mazing_thread_stats;
+
+#define COUNT_CALL(op) (mazing_thread_stats.op.calls++)
+#define COUNT_MUL(op, x, y) (mazing_thread_stats.op.muls++, \
+    mazing_thread_stats.op.limbs += mpz_size(x) + mpz_size(y))
+#define COUNT_SUBMUL(op, x, y) (mazing_thread_stats.op.submuls++, \
+    mazing_thread_stats.op.limbs += mpz_size(x) + mpz_size(y))
+#define COUNT_DIVEXACT(op, x, y) (mazing_thread_stats.op.divexacts++, \
+    mazing_thread_stats.op.limbs += mpz_size(x) + mpz_size(y))
+
+void stats_try_edge(int rows);
+void stats_begin_maze(int height);
+
+#else
+
+#define COUNT_CALL(op) ((void) 0)
+#define COUNT_MUL(op, x, y) ((void) 0)
+#define COUNT_SUBMUL(op, x, y) ((void) 0)
+#define COUNT_DIVEXACT(op, x, y) ((void) 0)
+
+#endif
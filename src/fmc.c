@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <gmp.h>
 #include "fmc.h"
+#include "stats.h"
+#include "counters.h"
 
 /** Small helper functions **/
 
@@ -140,6 +142,8 @@ static void bareiss(fmc_matrix *m)
     int n = m->n;
     mpz_t *mkk=0, *mkk_prev;
     
+    COUNT_CALL(bareiss);
+    
     for (int k=0; k < n; k++)
     {
         mkk_prev = mkk;
@@ -153,9 +157,14 @@ static void bareiss(fmc_matrix *m)
                 mpz_t *mij = ent(m,i,j);
                 mpz_t *mjk = ent(m,j,k);
                 
+                COUNT_MUL(bareiss, *mij, *mkk);
                 mpz_mul(*mij, *mij, *mkk);
+                COUNT_SUBMUL(bareiss, *mik, *mjk);
                 mpz_submul(*mij, *mik, *mjk);
-                if (k > 0) mpz_divexact(*mij, *mij, *mkk_prev);
+                if (k > 0) {
+                    COUNT_DIVEXACT(bareiss, *mij, *mkk_prev);
+                    mpz_divexact(*mij, *mij, *mkk_prev);
+                }
             }
         }
     }
@@ -237,6 +246,14 @@ and store the result in 'out'.
 */
 void fmc(mpz_t *out, int width, int height)
 {
+    if (width == 1 || height == 1)
+    {
+        /* The only maze is a straight corridor, and the dual
+           is too small for the method below to work. */
+        mpz_set_ui(*out, 1);
+        return;
+    }
+    
     fmc_matrix *m = dmf(width, height);
     bareiss(m);
     mpz_set(*out, m->entries[tri(m->n) - 1]);
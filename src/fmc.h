@@ -1 +1,15 @@
 void fmc(mpz_t *out, int width, int height);
+
+/* A persistent, shared store of maze counts: see fmc_store.c.
+   All of these are safe to call from several threads at once. */
+typedef struct fmc_store fmc_store_t;
+
+/* How big a store the programs create, if asked to use one that doesn't exist */
+#define FMC_STORE_DEFAULT_MAX_DIM 1024
+
+fmc_store_t *fmc_store_open(const char *path, int max_dim);
+void fmc_store_close(fmc_store_t *store);
+int fmc_store_get(fmc_store_t *store, mpz_t *out, int width, int height);
+int fmc_store_put(fmc_store_t *store, mpz_t *count, int width, int height);
+int fmc_store_fill(fmc_store_t *store, int max_width, int max_height, int num_threads);
+void fmc_cached(fmc_store_t *store, mpz_t *out, int width, int height);
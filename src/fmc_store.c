@@ -0,0 +1,412 @@
+/* fmc_store.c - A persistent store of maze counts */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <gmp.h>
+#include "fmc.h"
+
+/** The file format **
+
+The file starts with a header, followed by an index with one slot
+for each grid size up to max_dim x max_dim, and then the counts
+themselves, in whatever order they were added.
+
+Since a 'width'x'height' grid has the same number of mazes as a
+'height'x'width' one, each pair of sizes shares a slot: the slot for
+'lo' <= 'hi' is at tri(hi - 1) + (lo - 1). The slot holds the file
+offset of the record for that size, or zero if it isn't known yet.
+
+Records are written, and synced to disk, before the slot that points
+to them, and each record repeats its size, so a reader can never see
+a half-written record that its index slot claims is complete, and a
+torn write left over from a crash is simply treated as missing.
+*/
+
+#define STORE_MAGIC "MAZING\0C"
+#define STORE_VERSION 1
+#define STORE_BYTE_ORDER 0x01020304
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t limb_bytes;
+    int32_t max_dim;
+} store_header_t;
+
+typedef struct {
+    int32_t lo, hi;
+    int64_t size; /* number of limbs */
+} store_record_t;
+
+struct fmc_store {
+    int fd;
+    int max_dim;
+    pthread_mutex_t write_lock; /* flock only keeps other processes out */
+    pthread_rwlock_t map_lock;  /* held for writing while we remap */
+    char *map;
+    size_t map_len;
+};
+
+/* The nth triangular number */
+inline static uint64_t tri(uint64_t n)
+{
+    return n * (n+1) / 2;
+}
+
+/* Where the index slot for this size lives in the file */
+static off_t slot_offset(int width, int height)
+{
+    int lo = width < height ? width : height;
+    int hi = width < height ? height : width;
+    return sizeof(store_header_t) + sizeof(uint64_t) * (tri(hi - 1) + lo - 1);
+}
+
+/* Where the records start, i.e. the size of a store with no counts in it */
+static off_t records_offset(int max_dim)
+{
+    return sizeof(store_header_t) + sizeof(uint64_t) * tri(max_dim);
+}
+
+
+/** Mapping **/
+
+/* Map the file as it is now. Call with map_lock held for writing. */
+static int store_remap(fmc_store_t *store)
+{
+    struct stat st;
+    if (fstat(store->fd, &st) != 0)
+        return -1;
+
+    if (store->map)
+        munmap(store->map, store->map_len);
+
+    store->map_len = st.st_size;
+    store->map = mmap(0, store->map_len, PROT_READ, MAP_SHARED, store->fd, 0);
+    if (store->map == MAP_FAILED) {
+        store->map = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* Look up a count in the mapped file. Call with map_lock held for reading.
+Returns 1 if found, 0 if not, or -1 if the record lies beyond the map. */
+static int store_lookup(fmc_store_t *store, mpz_t *out, int width, int height)
+{
+    if (!store->map)
+        return -1;
+
+    uint64_t offset = *(volatile uint64_t *) (store->map + slot_offset(width, height));
+    if (offset == 0)
+        return 0;
+    if (offset > store->map_len || store->map_len - offset < sizeof(store_record_t))
+        return -1;
+
+    store_record_t *rec = (store_record_t *) (store->map + offset);
+    int lo = width < height ? width : height;
+    int hi = width < height ? height : width;
+    if (rec->size < 0 || (uint64_t) rec->size > (store->map_len - offset - sizeof *rec) / sizeof(mp_limb_t))
+        return -1;
+    if (rec->lo != lo || rec->hi != hi)
+        return 0;
+
+    mp_limb_t *limbs = mpz_limbs_write(*out, rec->size > 0 ? rec->size : 1);
+    memcpy(limbs, rec + 1, sizeof(mp_limb_t) * rec->size);
+    mpz_limbs_finish(*out, rec->size);
+    return 1;
+}
+
+
+/** Opening and closing **/
+
+/* Write the header and an empty index to a newly-created file */
+static int store_create(int fd, int max_dim)
+{
+    store_header_t header;
+
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, STORE_MAGIC, sizeof header.magic);
+    header.version = STORE_VERSION;
+    header.byte_order = STORE_BYTE_ORDER;
+    header.limb_bytes = sizeof(mp_limb_t);
+    header.max_dim = max_dim;
+
+    if (ftruncate(fd, records_offset(max_dim)) != 0)
+        return -1;
+    if (pwrite(fd, &header, sizeof header, 0) != sizeof header)
+        return -1;
+    return 0;
+}
+
+/* Open the count store in the file 'path', creating it if necessary
+with room for grids up to 'max_dim'x'max_dim'. If the file already
+exists, its own max_dim is used instead.
+
+Returns NULL (with errno set) on failure. */
+fmc_store_t *fmc_store_open(const char *path, int max_dim)
+{
+    store_header_t header;
+    struct stat st;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0)
+        return 0;
+
+    /* Only one process gets to initialise a new file */
+    flock(fd, LOCK_EX);
+    if (fstat(fd, &st) != 0 || (st.st_size == 0 && store_create(fd, max_dim) != 0))
+    {
+        flock(fd, LOCK_UN);
+        close(fd);
+        return 0;
+    }
+    flock(fd, LOCK_UN);
+
+    if (pread(fd, &header, sizeof header, 0) != sizeof header
+        || memcmp(header.magic, STORE_MAGIC, sizeof header.magic) != 0
+        || header.version != STORE_VERSION
+        || header.byte_order != STORE_BYTE_ORDER
+        || header.limb_bytes != sizeof(mp_limb_t)
+        || header.max_dim <= 0)
+    {
+        close(fd);
+        errno = EINVAL;
+        return 0;
+    }
+
+    fmc_store_t *store = malloc(sizeof(fmc_store_t));
+    store->fd = fd;
+    store->max_dim = header.max_dim;
+    store->map = 0;
+    store->map_len = 0;
+    pthread_mutex_init(&store->write_lock, 0);
+    pthread_rwlock_init(&store->map_lock, 0);
+
+    if (store_remap(store) != 0 || store->map_len < (size_t) records_offset(store->max_dim))
+    {
+        fmc_store_close(store);
+        errno = EINVAL;
+        return 0;
+    }
+
+    return store;
+}
+
+/* Close the store */
+void fmc_store_close(fmc_store_t *store)
+{
+    if (store->map)
+        munmap(store->map, store->map_len);
+    close(store->fd);
+    pthread_rwlock_destroy(&store->map_lock);
+    pthread_mutex_destroy(&store->write_lock);
+    free(store);
+}
+
+
+/** Reading and writing counts **/
+
+/* Look up the number of mazes on a 'width'x'height' grid.
+Returns 1 and stores the count in 'out' if it's in the store,
+or returns 0 if it isn't. */
+int fmc_store_get(fmc_store_t *store, mpz_t *out, int width, int height)
+{
+    if (width <= 0 || height <= 0 || width > store->max_dim || height > store->max_dim)
+        return 0;
+
+    pthread_rwlock_rdlock(&store->map_lock);
+    int found = store_lookup(store, out, width, height);
+    pthread_rwlock_unlock(&store->map_lock);
+
+    if (found < 0)
+    {
+        /* Someone else has added to the file since we mapped it */
+        pthread_rwlock_wrlock(&store->map_lock);
+        found = store_remap(store) == 0 ? store_lookup(store, out, width, height) : -1;
+        pthread_rwlock_unlock(&store->map_lock);
+    }
+
+    return found > 0;
+}
+
+/* Add the number of mazes on a 'width'x'height' grid to the store,
+unless it's already there. Safe to call from several threads or
+processes at once.
+
+Returns 0 on success, or -1 (with errno set) on failure. */
+int fmc_store_put(fmc_store_t *store, mpz_t *count, int width, int height)
+{
+    if (width <= 0 || height <= 0 || width > store->max_dim || height > store->max_dim) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    off_t slot = slot_offset(width, height);
+    uint64_t offset;
+    struct stat st;
+    int result = -1;
+
+    pthread_mutex_lock(&store->write_lock);
+    flock(store->fd, LOCK_EX);
+
+    store_record_t rec;
+    rec.lo = width < height ? width : height;
+    rec.hi = width < height ? height : width;
+
+    if (fstat(store->fd, &st) != 0
+        || pread(store->fd, &offset, sizeof offset, slot) != sizeof offset)
+        goto done;
+
+    /* Check again now we have the lock: someone may have beaten us to it.
+       (If the record they wrote is not intact, we write it again.) */
+    if (offset != 0)
+    {
+        store_record_t old;
+        if (pread(store->fd, &old, sizeof old, offset) == sizeof old
+            && old.lo == rec.lo && old.hi == rec.hi && old.size >= 0
+            && (uint64_t) old.size <= (st.st_size - offset - sizeof old) / sizeof(mp_limb_t))
+        {
+            result = 0;
+            goto done;
+        }
+    }
+
+    /* Append the record, keeping the limbs aligned */
+    rec.size = mpz_size(*count);
+    offset = (st.st_size + 7) & ~(uint64_t) 7;
+
+    size_t limbs_len = sizeof(mp_limb_t) * rec.size;
+    if (pwrite(store->fd, &rec, sizeof rec, offset) != sizeof rec
+        || pwrite(store->fd, mpz_limbs_read(*count), limbs_len, offset + sizeof rec) != (ssize_t) limbs_len)
+        goto done;
+
+    /* Make sure the record is on disk before anything points to it,
+       or a crash could leave the slot without the limbs */
+    if (fdatasync(store->fd) != 0)
+        goto done;
+
+    /* Now publish it */
+    if (pwrite(store->fd, &offset, sizeof offset, slot) != sizeof offset)
+        goto done;
+    result = 0;
+
+done:
+    flock(store->fd, LOCK_UN);
+    pthread_mutex_unlock(&store->write_lock);
+    return result;
+}
+
+/* The number of mazes on a 'width'x'height' grid, as fmc computes it,
+but looked up in 'store' if possible. If it's not there, it's computed
+and then added to the store. 'store' may be NULL, in which case this is
+the same as fmc. */
+void fmc_cached(fmc_store_t *store, mpz_t *out, int width, int height)
+{
+    if (store && fmc_store_get(store, out, width, height))
+        return;
+
+    fmc(out, width, height);
+
+    if (store && width <= store->max_dim && height <= store->max_dim)
+        fmc_store_put(store, out, width, height);
+}
+
+
+/** Filling the store in parallel **/
+
+typedef struct {
+    fmc_store_t *store;
+    int num_sizes;
+    int (*sizes)[2];
+    int next;
+    int failed;
+    pthread_mutex_t lock;
+} fill_t;
+
+static void *fill_worker(void *arg)
+{
+    fill_t *f = arg;
+    mpz_t count;
+
+    mpz_init(count);
+    for (;;)
+    {
+        pthread_mutex_lock(&f->lock);
+        int i = f->next++;
+        pthread_mutex_unlock(&f->lock);
+
+        if (i >= f->num_sizes)
+            break;
+
+        int lo = f->sizes[i][0], hi = f->sizes[i][1];
+        if (fmc_store_get(f->store, &count, lo, hi))
+            continue;
+
+        fmc(&count, lo, hi);
+        if (fmc_store_put(f->store, &count, lo, hi) != 0)
+        {
+            pthread_mutex_lock(&f->lock);
+            f->failed = 1;
+            pthread_mutex_unlock(&f->lock);
+        }
+    }
+    mpz_clear(count);
+
+    return 0;
+}
+
+/* Make sure the store has the counts for every grid up to
+'max_width'x'max_height' (in either orientation, and as far as
+the store's max_dim allows), computing any missing ones using
+'num_threads' threads.
+
+Returns 0 on success, or -1 if any count could not be stored. */
+int fmc_store_fill(fmc_store_t *store, int max_width, int max_height, int num_threads)
+{
+    fill_t f;
+    int max_lo = max_width < max_height ? max_width : max_height;
+    int max_hi = max_width < max_height ? max_height : max_width;
+    if (max_hi > store->max_dim) max_hi = store->max_dim;
+    if (max_lo > max_hi) max_lo = max_hi;
+
+    /* Largest first, so no thread is left with a big one at the end */
+    f.store = store;
+    f.num_sizes = 0;
+    f.sizes = malloc(sizeof(int[2]) * (max_lo > 0 ? (size_t) max_lo * max_hi : 1));
+    for (int hi = max_hi; hi > 0; hi--)
+        for (int lo = (hi < max_lo ? hi : max_lo); lo > 0; lo--)
+        {
+            f.sizes[f.num_sizes][0] = lo;
+            f.sizes[f.num_sizes][1] = hi;
+            f.num_sizes++;
+        }
+    f.next = 0;
+    f.failed = 0;
+    pthread_mutex_init(&f.lock, 0);
+
+    if (num_threads < 1) num_threads = 1;
+    pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+    for (int t = 0; t < num_threads; t++)
+        pthread_create(&threads[t], 0, fill_worker, &f);
+    for (int t = 0; t < num_threads; t++)
+        pthread_join(threads[t], 0);
+
+    free(threads);
+    free(f.sizes);
+    pthread_mutex_destroy(&f.lock);
+
+    return f.failed ? -1 : 0;
+}
@@ -1,21 +1,79 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <signal.h>
 #include <sysexits.h>
 #include <gmp.h>
 
 #include "mazing.h"
 #include "fmc.h"
+#include "stats.h"
+#include "batch.h"
+
+static void usage(char *argv0)
+{
+    fprintf(stderr, "Usage: %s width height [index]\n", argv0);
+    fprintf(stderr, "       %s width height --batch [file]\n", argv0);
+    fprintf(stderr, "       %s width height --prepare file\n", argv0);
+    fprintf(stderr, "       %s width height --fill-counts file\n", argv0);
+    fprintf(stderr, "       %s width height index --checkpoint file\n", argv0);
+    fprintf(stderr, "       %s width height --resume file\n", argv0);
+}
+
+/* If MAZING_COUNTS names a count store, open it; otherwise return NULL */
+static fmc_store_t *open_count_store(void)
+{
+    char *path = getenv("MAZING_COUNTS");
+    if (!path || !*path)
+        return 0;
+    
+    fmc_store_t *store = fmc_store_open(path, FMC_STORE_DEFAULT_MAX_DIM);
+    if (!store)
+        perror(path);
+    return store;
+}
+
+/* Should we print the counters from stats.h when we're done? */
+static int want_stats(void)
+{
+    char *env = getenv("MAZING_STATS");
+    if (!env || !*env || strcmp(env, "0") == 0)
+        return 0;
+    
+    if (!mazing_stats_enabled())
+    {
+        fprintf(stderr, "MAZING_STATS is set, but this build has no counters "
+                        "(configure with -DMAZING_STATS=ON)\n");
+        return 0;
+    }
+    return 1;
+}
+
+/* Print this thread's counters, if they were asked for */
+static void print_stats(void)
+{
+    mazing_stats_t stats;
+    
+    if (!want_stats())
+        return;
+    mazing_stats_get(&stats);
+    mazing_stats_print(stderr, &stats);
+    mazing_stats_reset();
+}
 
 void print_count(int width, int height)
 {
     mpz_t count;
+    fmc_store_t *store = open_count_store();
     
     mpz_init(count);
-    fmc(&count, width, height);
+    fmc_cached(store, &count, width, height);
+    if (store) fmc_store_close(store);
     
     size_t optimal_bits = mpz_sizeinbase(count, 2);
     int naive_bits = (width-1)*height + width*(height-1); /* i.e. using 1 bit per edge of the graph */
     
+    print_stats();
     gmp_printf("There are %Zd different mazes on a %dx%d grid. "
                "That’s a %zd-bit number, compared with %d bits for a naive packing, a saving of %.2f%%.\n",
         count, width, height, optimal_bits, naive_bits, 100.0 * (1.0 - (float) optimal_bits / naive_bits));
@@ -30,18 +88,129 @@ void print_maze(int width, int height, mpz_t index)
         fprintf(stderr, "Index number out of range\n");
         exit(EX_USAGE);
     }
+    print_stats();
     maze_print(maze);
     maze_free(maze);
 }
 
+/** Checkpointed unranking **
+
+When unranking with a checkpoint file, progress is shown on stderr,
+the unranking is saved to the file every CHECKPOINT_SECONDS, and an
+interrupt (or SIGTERM) stops it and saves it there too, so that it can
+be carried on with --resume.
+*/
+
+#define CHECKPOINT_SECONDS 600
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void on_interrupt(int sig)
+{
+    (void) sig;
+    interrupted = 1;
+}
+
+typedef struct {
+    maze_ctx_t *ctx;
+    maze_t *maze;
+    char *path;
+    double last_shown, last_saved;
+} checkpointing_t;
+
+/* Show progress at most once a second, save a checkpoint now and
+then, and stop if interrupted */
+static int show_progress(const maze_progress_t *p, void *arg)
+{
+    checkpointing_t *c = arg;
+    
+    if (p->elapsed - c->last_shown >= 1.0)
+    {
+        fprintf(stderr, "\rCell %d of %d, %ld of %ld edges decided",
+            p->num_cells - p->cell, p->num_cells, p->edges_decided, p->num_edges);
+        if (p->eta >= 0)
+            fprintf(stderr, ", about %.0fs to go", p->eta);
+        fprintf(stderr, "   ");
+        c->last_shown = p->elapsed;
+    }
+    
+    if (!interrupted && p->elapsed - c->last_saved >= CHECKPOINT_SECONDS)
+    {
+        if (maze_ctx_checkpoint(c->ctx, c->maze, c->path) != 0)
+            perror(c->path);
+        c->last_saved = p->elapsed;
+    }
+    return interrupted;
+}
+
+/* Unrank 'index', or if it's NULL carry on from the checkpoint at 'path' */
+int checkpointed_maze(int width, int height, mpz_t *index, char *path)
+{
+    maze_ctx_t *ctx = maze_ctx_new(width, height);
+    maze_t *maze = maze_init(width, height);
+    checkpointing_t c = { ctx, maze, path, 0, 0 };
+    maze_status status;
+    
+    signal(SIGINT, on_interrupt);
+    signal(SIGTERM, on_interrupt);
+    maze_ctx_set_progress(ctx, show_progress, &c);
+    
+    if (index)
+        status = maze_ctx_unrank(ctx, *index, maze);
+    else
+        status = maze_ctx_resume(ctx, path, maze);
+    if (c.last_shown > 0)
+        fprintf(stderr, "\n");
+    
+    int result = 0;
+    switch (status)
+    {
+        case MAZE_OK:
+            print_stats();
+            maze_print(maze);
+            remove(path);
+            break;
+        
+        case MAZE_OUT_OF_RANGE:
+            fprintf(stderr, "Index number out of range\n");
+            result = EX_USAGE;
+            break;
+        
+        case MAZE_INVALID:
+            perror(path);
+            result = EX_DATAERR;
+            break;
+        
+        case MAZE_CANCELLED:
+            if (maze_ctx_checkpoint(ctx, maze, path) != 0)
+            {
+                perror(path);
+                result = EX_CANTCREAT;
+                break;
+            }
+            fprintf(stderr, "Interrupted. To carry on: mazing %d %d --resume %s\n",
+                width, height, path);
+            result = EX_TEMPFAIL;
+            break;
+    }
+    
+    maze_free(maze);
+    maze_ctx_free(ctx);
+    return result;
+}
+
 int main(int argc, char **argv)
 {
     int width, height;
     mpz_t index;
     
-    if (argc < 3 || argc > 4)
+    if (argc < 3 || argc > 6 || (argc == 5 && strcmp(argv[3], "--batch") != 0
+                                           && strcmp(argv[3], "--prepare") != 0
+                                           && strcmp(argv[3], "--fill-counts") != 0
+                                           && strcmp(argv[3], "--resume") != 0)
+                             || (argc == 6 && strcmp(argv[4], "--checkpoint") != 0))
     {
-        fprintf(stderr, "Usage: %s width height [index]\n", argv[0]);
+        usage(argv[0]);
         return EX_USAGE;
     }
     
@@ -50,7 +219,7 @@ int main(int argc, char **argv)
     
     if (width <= 0 || height <= 0)
     {
-        fprintf(stderr, "Usage: %s width height [index]\n", argv[0]);
+        usage(argv[0]);
         fprintf(stderr, "width and height must be positive\n");
         return EX_USAGE;
     }
@@ -61,10 +230,103 @@ int main(int argc, char **argv)
         return 0;
     }
     
+    if (strcmp(argv[3], "--batch") == 0)
+    {
+        /* Construct a maze for each index in the input */
+        FILE *in = stdin;
+        if (argc == 5 && strcmp(argv[4], "-") != 0 && !(in = fopen(argv[4], "r")))
+        {
+            perror(argv[4]);
+            return EX_NOINPUT;
+        }
+        
+        mazing_stats_t stats;
+        memset(&stats, 0, sizeof stats);
+        if (want_stats())
+        {
+            stats.num_rows = height;
+            stats.row_seconds = calloc(height, sizeof(double));
+        }
+        
+        int status = batch_run(width, height, in, stdout, batch_default_threads(),
+            stats.row_seconds ? &stats : 0);
+        if (in != stdin) fclose(in);
+        
+        if (stats.row_seconds)
+        {
+            mazing_stats_print(stderr, &stats);
+            free(stats.row_seconds);
+        }
+        return status;
+    }
+    
+    if (strcmp(argv[3], "--prepare") == 0)
+    {
+        /* Save the prepared state for this size, for maze_ctx_load */
+        if (argc != 5)
+        {
+            usage(argv[0]);
+            return EX_USAGE;
+        }
+        
+        maze_ctx_t *ctx = maze_ctx_new(width, height);
+        if (maze_ctx_save(ctx, argv[4]) != 0)
+        {
+            perror(argv[4]);
+            maze_ctx_free(ctx);
+            return EX_CANTCREAT;
+        }
+        maze_ctx_free(ctx);
+        return 0;
+    }
+    
+    if (strcmp(argv[3], "--fill-counts") == 0)
+    {
+        /* Fill in the count store for all sizes up to this one */
+        if (argc != 5)
+        {
+            usage(argv[0]);
+            return EX_USAGE;
+        }
+        
+        int max_dim = width > height ? width : height;
+        fmc_store_t *store = fmc_store_open(argv[4],
+            max_dim > FMC_STORE_DEFAULT_MAX_DIM ? max_dim : FMC_STORE_DEFAULT_MAX_DIM);
+        if (!store)
+        {
+            perror(argv[4]);
+            return EX_CANTCREAT;
+        }
+        
+        int status = fmc_store_fill(store, width, height, batch_default_threads());
+        fmc_store_close(store);
+        if (status != 0)
+        {
+            perror(argv[4]);
+            return EX_IOERR;
+        }
+        return 0;
+    }
+    
+    if (strcmp(argv[3], "--resume") == 0)
+    {
+        /* Carry on from a checkpoint */
+        if (argc != 5)
+        {
+            usage(argv[0]);
+            return EX_USAGE;
+        }
+        return checkpointed_maze(width, height, 0, argv[4]);
+    }
+    
     /* Construct a maze by index */
     mpz_init(index);
     gmp_sscanf(argv[3], "%Zd", &index);
-    print_maze(width, height, index);
+    int status = 0;
+    if (argc == 6)
+        status = checkpointed_maze(width, height, &index, argv[5]);
+    else
+        print_maze(width, height, index);
     mpz_clear(index);
-    return 0;
+    return status;
 }
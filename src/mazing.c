@@ -1,11 +1,22 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <gmp.h>
 #include "mazing.h"
+#include "stats.h"
+#include "counters.h"
+#include "timing.h"
 
 
 /** Small macro-like utility functions **/
@@ -80,30 +91,36 @@ void maze_free(maze_t *maze)
     free(maze);
 }
 
-/* Print the maze to stdout, in ascii art style */
-void maze_print(maze_t *maze)
+/* Print the maze to 'out', in ascii art style */
+void maze_fprint(FILE *out, maze_t *maze)
 {
     int w = maze->width, h = maze->height;
     
     for (int y = 0; y < h; y++)
     {
         for (int x = 0; x < w; x++)
-            printf( (maze->conn[w*y + x] & DIR_N) == 0 ? "+---" : "+   " );
-        printf("+\n|");
+            fputs( (maze->conn[w*y + x] & DIR_N) == 0 ? "+---" : "+   ", out );
+        fputs("+\n|", out);
         
         for (int x = 0; x < w; x++)
         {
-            printf("   ");
-            printf( (maze->conn[w*y + x] & DIR_E) == 0 ? "|" : " " );
+            fputs("   ", out);
+            fputs( (maze->conn[w*y + x] & DIR_E) == 0 ? "|" : " ", out );
         }
-        printf("\n");
+        fputs("\n", out);
     }
     
     for (int x = 0; x < w; x++)
-        printf("+---");
-    printf("+");
+        fputs("+---", out);
+    fputs("+", out);
     
-    printf("\n\n");
+    fputs("\n\n", out);
+}
+
+/* Print the maze to stdout */
+void maze_print(maze_t *maze)
+{
+    maze_fprint(stdout, maze);
 }
 
 /** Matrix functions **
@@ -123,7 +140,7 @@ makes the code simpler.
 /* Allocate a zero matrix with 'num_rows' rows (and columns),
 and a row length of 'row_length', i.e. a half-bandwidth of
 (row_length - 1). */
-matrix_t *matrix_init(int num_rows, int row_length, int det_start)
+static matrix_t *matrix_init(int num_rows, int row_length, int det_start)
 {
     matrix_t *m = malloc(sizeof(matrix_t) + sizeof(row_t *) * num_rows);
     
@@ -151,7 +168,7 @@ matrix_t *matrix_init(int num_rows, int row_length, int det_start)
 }
 
 /* Free the matrix. */
-void matrix_free(matrix_t *m)
+static void matrix_free(matrix_t *m)
 {
     for (int i=0; i < m->n; i++)
     {
@@ -192,7 +209,7 @@ inline static ent_t *ent_eo(matrix_t *m, int i, int j)
 }
 
 /* The Laplacian matrix for a 'width' x 'height' grid. */
-matrix_t *grid_matrix(int width, int height)
+static matrix_t *grid_matrix(int width, int height)
 {
     int n = width * height;
     matrix_t *m = matrix_init(n, width + 1, 1);
@@ -257,6 +274,8 @@ static void det_init(matrix_t *m)
 {
     int n = m->nr, w = m->w;
     
+    COUNT_CALL(det_init);
+    
     /* Copy the original matrix to the Bareiss matrix */
     for (int i=0; i < n; i++)
     {
@@ -285,9 +304,14 @@ static void det_init(matrix_t *m)
                 ent_t *mjk = ent(m,j,k);
                 ent_t *mij = ent_r(row_i,j);
                 
+                COUNT_MUL(det_init, mij->bv, mkk->bv);
                 mpz_mul(mij->bv, mij->bv, mkk->bv);
+                COUNT_SUBMUL(det_init, mik->bv, mjk->bv);
                 mpz_submul(mij->bv, mik->bv, mjk->bv);
-                if (mkk_prev) mpz_divexact(mij->bv, mij->bv, mkk_prev->bv);
+                if (mkk_prev) {
+                    COUNT_DIVEXACT(det_init, mij->bv, mkk_prev->bv);
+                    mpz_divexact(mij->bv, mij->bv, mkk_prev->bv);
+                }
             }
         }
         if (k+w < n) {
@@ -296,6 +320,7 @@ static void det_init(matrix_t *m)
             for (int j = max(k+1, row_i->offset); j <= i; j++)
             {
                 ent_t *mij = ent_r(row_i,j);
+                COUNT_MUL(det_init, mij->bv, mkk->bv);
                 mpz_mul(mij->bv, mij->bv, mkk->bv);
             }
         }
@@ -317,6 +342,8 @@ inline static void det_changed(matrix_t *m, int i, int j)
 /* Update the Bareiss matrix to account for changes to the underlying matrix */
 static void det_update(matrix_t *m)
 {
+    COUNT_CALL(det_update);
+    
     /* Copy the original values over, for the changed part */ 
     for (int i = m->min_changed; i < m->nr; i++)
         for (int j = m->min_changed; j <= i; j++) {
@@ -336,6 +363,7 @@ static void det_update(matrix_t *m)
             for (int j = m->min_changed; j <= i; j++)
             {
                 mpz_t *mij = &ent(m,i,j)->bv;
+                COUNT_MUL(det_update, *mij, mkk->bv);
                 mpz_mul(*mij, *mij, mkk->bv);
             }
         
@@ -356,9 +384,14 @@ static void det_update(matrix_t *m)
                 ent_t *mij = ent(m,i,j);
                 ent_t *mjk = ent(m,j,k);
                 
+                COUNT_MUL(det_update, mij->bv, mkk->bv);
                 mpz_mul(mij->bv, mij->bv, mkk->bv);
+                COUNT_SUBMUL(det_update, mik->bv, mjk->bv);
                 mpz_submul(mij->bv, mik->bv, mjk->bv);
-                if (mkk_prev) mpz_divexact(mij->bv, mij->bv, mkk_prev->bv);
+                if (mkk_prev) {
+                    COUNT_DIVEXACT(det_update, mij->bv, mkk_prev->bv);
+                    mpz_divexact(mij->bv, mij->bv, mkk_prev->bv);
+                }
             }
         }
         mkk_prev = mkk;
@@ -373,11 +406,28 @@ static void det_update(matrix_t *m)
 The actual maze finding algorithm, descending the binary tree
 determined by the edges of the graph to find the maze that has
 a particular index in the in-order traversal.
+
+Ranking a maze, i.e. finding its index, descends the same tree,
+but follows the edges of the maze instead of comparing the index
+with the size of each subtree.
 */
 
-/* Decide which branch of the tree to descend down */
-static bool try_edge(matrix_t *m, mpz_t *index, int *node_chain,
-    int from_cell, int to_cell)
+#define EDGE_INVALID  (-1)
+#define EDGE_EXCLUDED 0
+#define EDGE_INCLUDED 1
+#define EDGE_UNKNOWN  2
+
+/* Decide which branch of the tree to descend down.
+
+When unranking, 'edge' is EDGE_UNKNOWN, and the edge is included if
+*index is at least the number of mazes without it, in which case that
+number is subtracted from *index. When ranking, 'edge' says whether the
+maze has this edge, and if it does the number is added to *index.
+
+Returns EDGE_INCLUDED or EDGE_EXCLUDED, or EDGE_INVALID if 'edge'
+asks for something that would not leave a maze. */
+static int try_edge(matrix_t *m, mpz_t *index, int *node_chain,
+    int from_cell, int to_cell, int edge)
 {
     int n_i = chain_root(node_chain, to_cell);
     int n_j = chain_root(node_chain, from_cell);
@@ -393,7 +443,7 @@ static bool try_edge(matrix_t *m, mpz_t *index, int *node_chain,
     if (mpz_cmp_ui(m_ij->ov, 0) >= 0)
     {
         /* from_cell is already connected to to_cell */
-        return false;
+        return edge == EDGE_INCLUDED ? EDGE_INVALID : EDGE_EXCLUDED;
     }
     
     ent_t *m_ii = ent(m, n_i, n_i);
@@ -405,18 +455,25 @@ static bool try_edge(matrix_t *m, mpz_t *index, int *node_chain,
     mpz_sub_ui(m_jj->ov, m_jj->ov, 1);
     mpz_add_ui(m_ij->ov, m_ij->ov, 1);
     det_changed(m, n_j, n_i);
+#ifdef MAZING_STATS
+    stats_try_edge(m->nr - m->min_changed);
+#endif
     det_update(m);
     
-    if (mpz_cmp(*index, *count_wo_edge) < 0)
+    bool ranking = (edge != EDGE_UNKNOWN);
+    if (edge == EDGE_UNKNOWN)
+        edge = mpz_cmp(*index, *count_wo_edge) < 0 ? EDGE_EXCLUDED : EDGE_INCLUDED;
+    
+    if (edge == EDGE_EXCLUDED)
     {
-        /* Don’t include the edge */
-        return false;
+        /* Don’t include the edge, unless there's no maze without it */
+        return mpz_sgn(*count_wo_edge) == 0 ? EDGE_INVALID : EDGE_EXCLUDED;
     }
     else
     {
         /* Do include it */
         int start_node = max(0, n_j - m->w + 1);
-        int end_node = min(m->n, n_i + m->w);
+        int end_node = min(m->nr, n_i + m->w);
         
         mpz_add(m_jj->ov, m_jj->ov, m_ii->ov);
         mpz_add(m_jj->ov, m_jj->ov, m_ij->ov);
@@ -437,62 +494,923 @@ static bool try_edge(matrix_t *m, mpz_t *index, int *node_chain,
                 det_changed(m,n_i,k);
             }
         }
-        mpz_sub(*index, *index, *count_wo_edge);
+        if (ranking)
+            mpz_add(*index, *index, *count_wo_edge);
+        else
+            mpz_sub(*index, *index, *count_wo_edge);
         chain_link(node_chain, n_i, n_j);
-        return true;
+        return EDGE_INCLUDED;
     }
 }
 
-/* Return the 'index_in'th maze on a 'width'x'height' grid.
+/** Prepared contexts **
 
-If index_in is out of range, returns NULL. (The quickest way
-to find out the allowed range is to use the Fast Maze Counter
-defined in fmc.c) */
-maze_t *maze_by_index(int width, int height, mpz_t index_in)
-{
+Everything that maze_by_index does before it starts descending the
+tree depends only on the size of the grid: building the Laplacian,
+and running the Bareiss algorithm over it. A context does that work
+once and keeps the result as a pristine matrix, which is never
+modified afterwards.
+
+The descent only ever modifies a trailing window of the matrix. At
+the time we are deciding the edges of cell i, every node that has
+been merged with another is at least i - width, so try_edge changes
+nothing below row i - width - w + 1, and rows beyond i are no longer
+active. So the working matrix starts out sharing all its rows with
+the pristine one, and each row is copied into a ring of 2w private
+rows just before the window reaches it. By the time a ring slot is
+reused, the row that was in it has dropped off the end.
+*/
+
+struct maze_ctx {
+    int width, height;
+    matrix_t *pristine; /* The grid Laplacian, with det_init already run */
+    matrix_t *m;        /* Working matrix: rows point into 'pristine' or 'ring' */
+    row_t **ring;       /* Private copies of the rows in the trailing window */
+    int ring_size;
+    int lo;             /* Lowest row of 'm' that has been copied into the ring */
+    int *node_chain;
     mpz_t index;
-    matrix_t *m = grid_matrix(width, height);
+    int cell;           /* The cell an unranking is paused before, or -1 */
+    long edges_decided;
+    maze_progress_fn progress;
+    void *progress_arg;
+    double *cost;       /* cost[i] estimates the work for cells 0 to i */
+    void *map;          /* If 'pristine' lives in a mapped file, the mapping */
+    size_t map_len;
+};
+
+/* Allocate a matrix header whose rows are those of 'src' */
+static matrix_t *matrix_share(matrix_t *src)
+{
+    matrix_t *m = malloc(sizeof(matrix_t) + sizeof(row_t *) * src->n);
+    
+    m->n = m->nr = src->n;
+    m->w = src->w;
+    m->det_start = src->det_start;
+    m->min_changed = src->min_changed;
+    mpz_init(m->zero.ov);
+    mpz_init(m->zero.bv);
+    memcpy(m->rows, src->rows, sizeof(row_t *) * src->n);
+    
+    return m;
+}
+
+/* Free a matrix allocated by matrix_share, leaving its rows alone */
+static void matrix_share_free(matrix_t *m)
+{
+    mpz_clear(m->zero.ov);
+    mpz_clear(m->zero.bv);
+    free(m);
+}
+
+/* Give row 'i' of the working matrix a private copy, in the ring */
+static void ctx_copy_row(maze_ctx_t *ctx, int i)
+{
+    row_t *src = ctx->pristine->rows[i];
+    row_t *dest = ctx->ring[i % ctx->ring_size];
+    int this_row_len = min(i+1, ctx->pristine->w);
+    
+    dest->offset = src->offset;
+    for (int j=0; j < this_row_len; j++)
+    {
+        mpz_set(dest->entries[j].ov, src->entries[j].ov);
+        mpz_set(dest->entries[j].bv, src->entries[j].bv);
+    }
+    ctx->m->rows[i] = dest;
+}
+
+/* Set up everything except the pristine matrix, which must already be there */
+static maze_ctx_t *ctx_init(maze_ctx_t *ctx)
+{
+    matrix_t *p = ctx->pristine;
+    
+    ctx->m = matrix_share(p);
+    ctx->ring_size = min(p->n, 2 * p->w);
+    ctx->ring = malloc(sizeof(row_t *) * ctx->ring_size);
+    for (int r = 0; r < ctx->ring_size; r++)
+    {
+        row_t *row = ctx->ring[r] = malloc(sizeof(row_t) + sizeof(ent_t) * p->w);
+        for (int j=0; j < p->w; j++)
+        {
+            mpz_init(row->entries[j].ov);
+            mpz_init(row->entries[j].bv);
+        }
+    }
+    ctx->lo = p->n;
+    ctx->node_chain = chain_init(p->n);
+    mpz_init(ctx->index);
+    ctx->cell = -1;
+    ctx->progress = 0;
+    ctx->cost = 0;
+    
+    return ctx;
+}
+
+/* Prepare a context for unranking mazes on a 'width'x'height' grid */
+maze_ctx_t *maze_ctx_new(int width, int height)
+{
+    maze_ctx_t *ctx = malloc(sizeof(maze_ctx_t));
+    
+    ctx->width = width;
+    ctx->height = height;
+    ctx->pristine = grid_matrix(width, height);
+    det_init(ctx->pristine);
+    ctx->map = 0;
+    ctx->map_len = 0;
+    
+    return ctx_init(ctx);
+}
+
+/* Free the context */
+void maze_ctx_free(maze_ctx_t *ctx)
+{
+    for (int r = 0; r < ctx->ring_size; r++)
+    {
+        for (int j=0; j < ctx->pristine->w; j++)
+        {
+            mpz_clear(ctx->ring[r]->entries[j].ov);
+            mpz_clear(ctx->ring[r]->entries[j].bv);
+        }
+        free(ctx->ring[r]);
+    }
+    free(ctx->ring);
+    matrix_share_free(ctx->m);
+    
+    if (ctx->map)
+    {
+        /* The entries point into the mapping, and must not be cleared */
+        for (int i=0; i < ctx->pristine->n; i++)
+            free(ctx->pristine->rows[i]);
+        matrix_share_free(ctx->pristine);
+        munmap(ctx->map, ctx->map_len);
+    }
+    else
+        matrix_free(ctx->pristine);
+    
+    chain_free(ctx->node_chain);
+    mpz_clear(ctx->index);
+    free(ctx->cost);
+    free(ctx);
+}
+
+/* Get ready to start a new descent */
+static void ctx_reset(maze_ctx_t *ctx)
+{
+    matrix_t *m = ctx->m;
     int n = m->n;
-    maze_t *maze = maze_init(width, height);
-    int *node_chain = chain_init(n);
     
-    mpz_init_set(index, index_in);
+    /* Go back to sharing every row with the pristine matrix */
+    for (int i = ctx->lo; i < n; i++)
+        m->rows[i] = ctx->pristine->rows[i];
+    ctx->lo = n;
+    m->min_changed = n;
+    
+    for (int i = 0; i < n; i++)
+        ctx->node_chain[i] = i;
+    
+    ctx->cell = -1;
+    ctx->edges_decided = 0;
+    
+#ifdef MAZING_STATS
+    stats_begin_maze(ctx->height);
+#endif
+}
+
+/* Tell the progress function that we're about to decide cell 'i',
+having started this call at cell 'start' at time 'start_time'.
+Returns nonzero if it asks us to stop. */
+static int ctx_report(maze_ctx_t *ctx, int i, int start, double start_time)
+{
+    int w = ctx->width, h = ctx->height;
+    double done = ctx->cost[start] - ctx->cost[i];
+    maze_progress_t p;
+    
+    p.cell = i;
+    p.num_cells = w * h;
+    p.edges_decided = ctx->edges_decided;
+    p.num_edges = (long) (w-1) * h + (long) w * (h-1);
+    p.elapsed = mazing_timing_now() - start_time;
+    p.eta = done > 0 ? p.elapsed * ctx->cost[i] / done : -1;
+    
+    return ctx->progress(&p, ctx->progress_arg);
+}
+
+/* Descend the tree, as described under "Maze finding" above, from
+cell 'start' (which is n - 1 unless we are resuming) down. If 'ranking',
+follow the edges of 'maze' and leave its index in ctx->index; otherwise
+find the maze whose index is in ctx->index, and put it in 'maze'. */
+static maze_status ctx_descend(maze_ctx_t *ctx, maze_t *maze, bool ranking, int start)
+{
+    matrix_t *m = ctx->m;
+    int *node_chain = ctx->node_chain;
+    int width = ctx->width;
+    double start_time = ctx->progress ? mazing_timing_now() : 0;
     
-    det_init(m);
+#ifdef MAZING_STATS
+    double row_start = mazing_timing_now();
+#endif
     
-    for (int i = n - 1; i > 0; i--)
+    for (int i = start; i > 0; i--)
     {
+        if (ctx->progress)
+        {
+            /* Everything is as it was before this cell, so an unranking
+               can be checkpointed now, by the progress function or after
+               it cancels, and carried on later */
+            ctx->cell = ranking ? -1 : i;
+            if (ctx_report(ctx, i, start, start_time) != 0)
+                return MAZE_CANCELLED;
+            ctx->cell = -1;
+        }
+        
         m->nr = i + 1;
         
+#ifdef MAZING_STATS
+        if (i % width == width - 1 && i < m->n - 1)
+        {
+            /* We have just finished the row below this one */
+            double t = mazing_timing_now();
+            mazing_thread_stats.row_seconds[i / width + 1] += t - row_start;
+            row_start = t;
+        }
+#endif
+        
+        while (ctx->lo > max(0, i - 2 * m->w + 1))
+            ctx_copy_row(ctx, --ctx->lo);
+        
         if (i >= width)
         {
             /* Not on the top row */
-            if (try_edge(m, &index, node_chain, i - width, i))
+            int edge = !ranking ? EDGE_UNKNOWN
+                     : (maze->conn[i] & DIR_N) ? EDGE_INCLUDED : EDGE_EXCLUDED;
+            edge = try_edge(m, &ctx->index, node_chain, i - width, i, edge);
+            if (edge == EDGE_INVALID)
+                return MAZE_INVALID;
+            if (edge == EDGE_INCLUDED && !ranking)
             {
                 maze->conn[i-width] |= DIR_S;
                 maze->conn[i] |= DIR_N;
             }
+            ctx->edges_decided++;
         }
         
         if (i % width)
         {
             /* Not in the leftmost column */
-            if (try_edge(m, &index, node_chain, i - 1, i))
+            int edge = !ranking ? EDGE_UNKNOWN
+                     : (maze->conn[i] & DIR_W) ? EDGE_INCLUDED : EDGE_EXCLUDED;
+            edge = try_edge(m, &ctx->index, node_chain, i - 1, i, edge);
+            if (edge == EDGE_INVALID)
+                return MAZE_INVALID;
+            if (edge == EDGE_INCLUDED && !ranking)
             {
                 maze->conn[i-1] |= DIR_E;
                 maze->conn[i] |= DIR_W;
             }
+            ctx->edges_decided++;
+        }
+    }
+    
+#ifdef MAZING_STATS
+    mazing_thread_stats.row_seconds[0] += mazing_timing_now() - row_start;
+#endif
+    
+    return MAZE_OK;
+}
+
+/* Carry on unranking from cell 'start' */
+static maze_status ctx_finish_unrank(maze_ctx_t *ctx, maze_t *out, int start)
+{
+    maze_status status = ctx_descend(ctx, out, false, start);
+    if (status != MAZE_OK)
+        return status;
+    
+    if (mpz_cmp_ui(ctx->index, 0) != 0)
+        return MAZE_OUT_OF_RANGE;
+    
+    return MAZE_OK;
+}
+
+/* Store the 'index_in'th maze on the context's grid in 'out', which must
+have been allocated (e.g. by maze_init) with the same width and height.
+
+Returns MAZE_OUT_OF_RANGE if there is no such maze, in which case
+the contents of 'out' are unspecified.
+
+Returns MAZE_CANCELLED if the progress function (see
+maze_ctx_set_progress) asked to stop, in which case 'out' holds
+the edges decided so far, and maze_ctx_checkpoint can save them. */
+maze_status maze_ctx_unrank(maze_ctx_t *ctx, mpz_t index_in, maze_t *out)
+{
+    assert(out->width == ctx->width && out->height == ctx->height);
+    
+    ctx_reset(ctx);
+    memset(out->conn, 0, ctx->width * ctx->height);
+    if (mpz_sgn(index_in) < 0)
+        return MAZE_OUT_OF_RANGE;
+    mpz_set(ctx->index, index_in);
+    
+    return ctx_finish_unrank(ctx, out, ctx->width * ctx->height - 1);
+}
+
+/* Do the connections of 'maze' agree with each other and with its edges? */
+static bool maze_consistent(maze_t *maze)
+{
+    int w = maze->width, h = maze->height;
+    
+    for (int i = 0; i < w * h; i++)
+    {
+        direction d = maze->conn[i];
+        int x = i % w, y = i / w;
+        
+        if (d & ~(DIR_N | DIR_E | DIR_S | DIR_W))
+            return false;
+        if ((d & DIR_N) && (y == 0 || !(maze->conn[i-w] & DIR_S)))
+            return false;
+        if ((d & DIR_S) && (y == h-1 || !(maze->conn[i+w] & DIR_N)))
+            return false;
+        if ((d & DIR_W) && (x == 0 || !(maze->conn[i-1] & DIR_E)))
+            return false;
+        if ((d & DIR_E) && (x == w-1 || !(maze->conn[i+1] & DIR_W)))
+            return false;
+    }
+    return true;
+}
+
+/* Find the index of 'maze', which must be the same size as the context's
+grid, and store it in 'index_out': the inverse of maze_ctx_unrank.
+
+Returns MAZE_INVALID if 'maze' is not a maze, i.e. if its connections
+do not form a spanning tree of the grid, or MAZE_CANCELLED if the
+progress function asked to stop. */
+maze_status maze_ctx_rank(maze_ctx_t *ctx, maze_t *maze, mpz_t index_out)
+{
+    assert(maze->width == ctx->width && maze->height == ctx->height);
+    
+    ctx_reset(ctx);
+    if (!maze_consistent(maze))
+        return MAZE_INVALID;
+    
+    mpz_set_ui(ctx->index, 0);
+    maze_status status = ctx_descend(ctx, maze, true, ctx->width * ctx->height - 1);
+    if (status != MAZE_OK)
+        return status;
+    
+    mpz_set(index_out, ctx->index);
+    return MAZE_OK;
+}
+
+
+/** Prepared state files **
+
+The pristine matrix of a context can be saved to a file, and a
+context can be created by mapping such a file into memory, which
+is much quicker than running det_init on a large grid. The mapping
+is read-only and shared, so any number of processes can use the
+same file at once without copying it; the entries of the pristine
+matrix point straight at the limbs in the file.
+
+The file holds a header, then a table with one entry for each
+stored element of the band (row by row, each row from its first
+stored column to the diagonal), then the limbs themselves. The
+numbers are stored in the native byte order, with the native limb
+size, and the header records both so that a file from some other
+kind of machine is refused rather than misread.
+*/
+
+#define STATE_MAGIC "MAZING\0S"
+#define STATE_VERSION 1
+#define STATE_BYTE_ORDER 0x01020304
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t limb_bytes;
+    int32_t width, height;
+    int32_t n, w, det_start;
+    uint64_t num_entries;
+    uint64_t num_limbs;
+} state_header_t;
+
+typedef struct {
+    int64_t size;    /* as in mpz_t: number of limbs, negated if the value is */
+    uint64_t offset; /* index of the first limb in the limb area */
+} state_num_t;
+
+typedef struct {
+    state_num_t ov, bv;
+} state_ent_t;
+
+/* Open a new temporary file next to 'path', to be renamed over it by
+temp_file_commit once it's complete. Its name is stored in *tmp_path.
+Returns NULL (with errno set) on failure. */
+static FILE *temp_file_open(const char *path, char **tmp_path)
+{
+    char *tmp = malloc(strlen(path) + 8);
+    sprintf(tmp, "%s.XXXXXX", path);
+    
+    int fd = mkstemp(tmp);
+    FILE *f = 0;
+    if (fd >= 0 && fchmod(fd, 0644) == 0)
+        f = fdopen(fd, "wb");
+    if (!f)
+    {
+        int e = errno;
+        if (fd >= 0) {
+            close(fd);
+            remove(tmp);
+        }
+        free(tmp);
+        errno = e;
+        return 0;
+    }
+    
+    *tmp_path = tmp;
+    return f;
+}
+
+/* Close a file opened by temp_file_open and, if it was all written,
+rename it to 'path'; otherwise remove it. Frees 'tmp_path'.
+Returns 0 on success, or -1 (with errno set) on failure. */
+static int temp_file_commit(FILE *f, char *tmp_path, const char *path)
+{
+    int failed = ferror(f);
+    errno = 0;
+    if (fclose(f) != 0 || failed || rename(tmp_path, path) != 0)
+    {
+        int e = errno ? errno : EIO;
+        remove(tmp_path);
+        free(tmp_path);
+        errno = e;
+        return -1;
+    }
+    
+    free(tmp_path);
+    return 0;
+}
+
+/* Fill in 'sn' to describe 'x', and write its limbs to 'f' */
+static void state_write_num(FILE *f, state_num_t *sn, uint64_t *num_limbs, mpz_t x)
+{
+    size_t size = mpz_size(x);
+    
+    sn->size = mpz_sgn(x) < 0 ? -(int64_t) size : (int64_t) size;
+    sn->offset = *num_limbs;
+    fwrite(mpz_limbs_read(x), sizeof(mp_limb_t), size, f);
+    *num_limbs += size;
+}
+
+/* Save the context's pristine matrix to the file 'path', so that
+maze_ctx_load can use it later. The file is written under a temporary
+name and then renamed, so a reader never sees half a file.
+
+Returns 0 on success, or -1 (with errno set) on failure. */
+int maze_ctx_save(maze_ctx_t *ctx, const char *path)
+{
+    matrix_t *p = ctx->pristine;
+    state_header_t header;
+    uint64_t num_entries = 0;
+    
+    for (int i = 0; i < p->n; i++)
+        num_entries += min(i+1, p->w);
+    
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, STATE_MAGIC, sizeof header.magic);
+    header.version = STATE_VERSION;
+    header.byte_order = STATE_BYTE_ORDER;
+    header.limb_bytes = sizeof(mp_limb_t);
+    header.width = ctx->width;
+    header.height = ctx->height;
+    header.n = p->n;
+    header.w = p->w;
+    header.det_start = p->det_start;
+    header.num_entries = num_entries;
+    header.num_limbs = 0;
+    
+    char *tmp_path;
+    FILE *f = temp_file_open(path, &tmp_path);
+    if (!f)
+        return -1;
+    
+    /* Write the limbs first, leaving room for the header and table */
+    state_ent_t *table = malloc(sizeof(state_ent_t) * num_entries);
+    long limbs_start = sizeof header + sizeof(state_ent_t) * num_entries;
+    fseek(f, limbs_start, SEEK_SET);
+    
+    state_ent_t *te = table;
+    for (int i = 0; i < p->n; i++)
+    {
+        int this_row_len = min(i+1, p->w);
+        for (int j=0; j < this_row_len; j++, te++)
+        {
+            state_write_num(f, &te->ov, &header.num_limbs, p->rows[i]->entries[j].ov);
+            state_write_num(f, &te->bv, &header.num_limbs, p->rows[i]->entries[j].bv);
+        }
+    }
+    
+    fseek(f, 0, SEEK_SET);
+    fwrite(&header, sizeof header, 1, f);
+    fwrite(table, sizeof(state_ent_t), num_entries, f);
+    free(table);
+    
+    return temp_file_commit(f, tmp_path, path);
+}
+
+/* Does the header describe a file we can use, of 'file_size' bytes? */
+static bool state_header_ok(state_header_t *h, size_t file_size)
+{
+    if (memcmp(h->magic, STATE_MAGIC, sizeof h->magic) != 0
+        || h->version != STATE_VERSION
+        || h->byte_order != STATE_BYTE_ORDER
+        || h->limb_bytes != sizeof(mp_limb_t))
+        return false;
+    
+    if (h->width <= 0 || h->height <= 0 || h->n != (int64_t) h->width * h->height
+        || h->w != (int64_t) h->width + 1 || h->det_start != 1)
+        return false;
+    
+    uint64_t num_entries = 0;
+    for (int i = 0; i < h->n; i++)
+        num_entries += min(i+1, h->w);
+    if (h->num_entries != num_entries)
+        return false;
+    
+    /* Check the sizes without multiplying anything that could wrap */
+    if (file_size < sizeof *h
+        || num_entries > (file_size - sizeof *h) / sizeof(state_ent_t))
+        return false;
+    size_t limbs_size = file_size - sizeof *h - sizeof(state_ent_t) * num_entries;
+    
+    return h->num_limbs <= limbs_size / sizeof(mp_limb_t)
+        && sizeof(mp_limb_t) * h->num_limbs == limbs_size;
+}
+
+/* Point 'x' at the limbs described by 'sn', if they are in range */
+static bool state_read_num(mpz_t x, state_num_t *sn, mp_limb_t *limbs, uint64_t num_limbs)
+{
+    uint64_t size = sn->size < 0 ? -(uint64_t) sn->size : (uint64_t) sn->size;
+    if (sn->offset > num_limbs || size > num_limbs - sn->offset)
+        return false;
+    
+    mpz_roinit_n(x, limbs + sn->offset, sn->size);
+    return true;
+}
+
+/* Create a context from a file written by maze_ctx_save.
+
+Returns NULL (with errno set) if the file cannot be read,
+or is not a valid prepared state file. */
+maze_ctx_t *maze_ctx_load(const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(state_header_t)) {
+        close(fd);
+        errno = EINVAL;
+        return 0;
+    }
+    
+    size_t map_len = st.st_size;
+    void *map = mmap(0, map_len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+    
+    state_header_t *h = map;
+    if (!state_header_ok(h, map_len)) {
+        munmap(map, map_len);
+        errno = EINVAL;
+        return 0;
+    }
+    
+    state_ent_t *table = (state_ent_t *) (h + 1);
+    mp_limb_t *limbs = (mp_limb_t *) (table + h->num_entries);
+    
+    /* A matrix header of the usual kind, whose entries point into the map */
+    matrix_t *p = malloc(sizeof(matrix_t) + sizeof(row_t *) * h->n);
+    p->n = p->nr = p->min_changed = h->n;
+    p->w = h->w;
+    p->det_start = h->det_start;
+    mpz_init(p->zero.ov);
+    mpz_init(p->zero.bv);
+    
+    bool ok = true;
+    state_ent_t *te = table;
+    for (int i = 0; i < h->n; i++)
+    {
+        int this_row_len = min(i+1, h->w);
+        row_t *row = p->rows[i] = malloc(sizeof(row_t) + sizeof(ent_t) * this_row_len);
+        row->offset = i+1 - this_row_len;
+        
+        for (int j=0; j < this_row_len; j++, te++)
+        {
+            ok = ok && state_read_num(row->entries[j].ov, &te->ov, limbs, h->num_limbs);
+            ok = ok && state_read_num(row->entries[j].bv, &te->bv, limbs, h->num_limbs);
+        }
+    }
+    
+    maze_ctx_t *ctx = malloc(sizeof(maze_ctx_t));
+    ctx->width = h->width;
+    ctx->height = h->height;
+    ctx->pristine = p;
+    ctx->map = map;
+    ctx->map_len = map_len;
+    ctx_init(ctx);
+    
+    if (!ok) {
+        maze_ctx_free(ctx);
+        errno = EINVAL;
+        return 0;
+    }
+    
+    return ctx;
+}
+
+/** Progress and checkpoints **
+
+Unranking a maze on a big grid can take hours, so a context can be
+given a progress function, which is called before each cell is
+decided and can ask for the descent to stop. An unranking that was
+stopped like that can be saved to a checkpoint file, and carried on
+later, in this process or another one, from the cell where it stopped.
+
+The ETA assumes that the work for each cell is proportional to the
+square of the size of the numbers in its row of the Bareiss matrix,
+and scales the time taken so far accordingly.
+
+A checkpoint holds everything that the descent has changed: the index
+that remains, the connections decided so far, the node chain, and
+the rows of the working matrix in the trailing window, followed by a
+checksum of all that, so that a damaged checkpoint is refused rather
+than giving a wrong maze. Like a prepared state file, it is only
+readable on the same kind of machine.
+*/
+
+/* Have fn(progress, arg) called before each cell is decided, by
+maze_ctx_unrank, maze_ctx_rank and maze_ctx_resume. If 'fn' is NULL,
+stop calling it. */
+void maze_ctx_set_progress(maze_ctx_t *ctx, maze_progress_fn fn, void *arg)
+{
+    matrix_t *p = ctx->pristine;
+    
+    ctx->progress = fn;
+    ctx->progress_arg = arg;
+    
+    if (fn && !ctx->cost)
+    {
+        double total = 0;
+        ctx->cost = malloc(sizeof(double) * p->n);
+        for (int i = 0; i < p->n; i++)
+        {
+            double limbs = mpz_size(ent(p, i, i)->bv) + 1;
+            total += limbs * limbs;
+            ctx->cost[i] = total;
+        }
+    }
+}
+
+#define CHECKPOINT_MAGIC "MAZING\0K"
+#define CHECKPOINT_VERSION 1
+
+/* No row of a checkpoint should have numbers anywhere near this big */
+#define CHECKPOINT_MAX_LIMBS (1 << 24)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t limb_bytes;
+    int32_t width, height;
+    int32_t cell;        /* The next cell to decide */
+    int32_t lo;          /* The rows from lo to cell follow */
+    int32_t min_changed;
+    int64_t edges_decided;
+} checkpoint_header_t;
+
+/* A checkpoint file being read or written. Everything goes through
+checkpoint_write or checkpoint_read, which keep a running FNV-1a hash
+of it, so that the file can end with a checksum of everything before. */
+typedef struct {
+    FILE *f;
+    uint64_t sum;
+} checkpoint_io_t;
+
+#define CHECKPOINT_SUM_START 14695981039346656037ULL
+
+static void checkpoint_sum(checkpoint_io_t *io, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    for (size_t i = 0; i < len; i++)
+        io->sum = (io->sum ^ p[i]) * 1099511628211ULL;
+}
+
+static void checkpoint_write(checkpoint_io_t *io, const void *buf, size_t len)
+{
+    fwrite(buf, 1, len, io->f);
+    checkpoint_sum(io, buf, len);
+}
+
+static bool checkpoint_read(checkpoint_io_t *io, void *buf, size_t len)
+{
+    if (fread(buf, 1, len, io->f) != len)
+        return false;
+    checkpoint_sum(io, buf, len);
+    return true;
+}
+
+static void checkpoint_write_num(checkpoint_io_t *io, mpz_t x)
+{
+    size_t size = mpz_size(x);
+    int64_t signed_size = mpz_sgn(x) < 0 ? -(int64_t) size : (int64_t) size;
+    
+    checkpoint_write(io, &signed_size, sizeof signed_size);
+    checkpoint_write(io, mpz_limbs_read(x), sizeof(mp_limb_t) * size);
+}
+
+static bool checkpoint_read_num(checkpoint_io_t *io, mpz_t x)
+{
+    int64_t signed_size;
+    if (!checkpoint_read(io, &signed_size, sizeof signed_size)
+        || signed_size < -CHECKPOINT_MAX_LIMBS || signed_size > CHECKPOINT_MAX_LIMBS)
+        return false;
+    
+    size_t size = signed_size < 0 ? -signed_size : signed_size;
+    mp_limb_t *limbs = mpz_limbs_write(x, size ? size : 1);
+    if (!checkpoint_read(io, limbs, sizeof(mp_limb_t) * size))
+        return false;
+    mpz_limbs_finish(x, signed_size);
+    return true;
+}
+
+/* Save the state of an unranking to the file 'path', so that
+maze_ctx_resume can carry it on. This can be done from the progress
+function, to save it every so often, or after the progress function
+has cancelled it. 'maze' must be the one that was passed to
+maze_ctx_unrank (or maze_ctx_resume). The file is written under a
+temporary name and then renamed, so a crash part way through leaves
+any earlier checkpoint intact.
+
+Returns 0 on success, or -1 (with errno set) on failure, including
+if there is no paused or cancelled unranking to save. */
+int maze_ctx_checkpoint(maze_ctx_t *ctx, maze_t *maze, const char *path)
+{
+    matrix_t *m = ctx->m;
+    checkpoint_header_t header;
+    
+    if (ctx->cell < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof header.magic);
+    header.version = CHECKPOINT_VERSION;
+    header.byte_order = STATE_BYTE_ORDER;
+    header.limb_bytes = sizeof(mp_limb_t);
+    header.width = ctx->width;
+    header.height = ctx->height;
+    header.cell = ctx->cell;
+    header.lo = min(ctx->lo, ctx->cell + 1);
+    header.min_changed = m->min_changed;
+    header.edges_decided = ctx->edges_decided;
+    
+    char *tmp_path;
+    checkpoint_io_t io = { temp_file_open(path, &tmp_path), CHECKPOINT_SUM_START };
+    if (!io.f)
+        return -1;
+    
+    checkpoint_write(&io, &header, sizeof header);
+    checkpoint_write_num(&io, ctx->index);
+    checkpoint_write(&io, maze->conn, m->n);
+    for (int i = 0; i < m->n; i++)
+    {
+        int32_t c = ctx->node_chain[i];
+        checkpoint_write(&io, &c, sizeof c);
+    }
+    for (int i = header.lo; i <= header.cell; i++)
+    {
+        int this_row_len = min(i+1, m->w);
+        for (int j=0; j < this_row_len; j++)
+        {
+            checkpoint_write_num(&io, m->rows[i]->entries[j].ov);
+            checkpoint_write_num(&io, m->rows[i]->entries[j].bv);
         }
     }
+    uint64_t sum = io.sum;
+    fwrite(&sum, sizeof sum, 1, io.f);
+    
+    return temp_file_commit(io.f, tmp_path, path);
+}
+
+/* Read a checkpoint into the context and 'out'. Returns false if the
+file is not an intact checkpoint for this context's grid. */
+static bool ctx_read_checkpoint(maze_ctx_t *ctx, FILE *f, maze_t *out, int *cell)
+{
+    matrix_t *m = ctx->m;
+    int n = m->n;
+    checkpoint_header_t h;
+    checkpoint_io_t io = { f, CHECKPOINT_SUM_START };
+    
+    if (!checkpoint_read(&io, &h, sizeof h)
+        || memcmp(h.magic, CHECKPOINT_MAGIC, sizeof h.magic) != 0
+        || h.version != CHECKPOINT_VERSION
+        || h.byte_order != STATE_BYTE_ORDER
+        || h.limb_bytes != sizeof(mp_limb_t)
+        || h.width != ctx->width || h.height != ctx->height
+        || h.cell <= 0 || h.cell >= n
+        || h.lo < 0 || h.lo > h.cell + 1 || h.cell + 1 - h.lo > ctx->ring_size
+        || h.min_changed < 0 || h.min_changed > n)
+        return false;
+    
+    if (!checkpoint_read_num(&io, ctx->index)
+        || !checkpoint_read(&io, out->conn, n))
+        return false;
+    
+    for (int i = 0; i < n; i++)
+    {
+        int32_t c;
+        /* chain_link always points a node at a smaller one, so anything
+           else would be a cycle, which chain_root would never get out of */
+        if (!checkpoint_read(&io, &c, sizeof c) || c < 0 || c > i)
+            return false;
+        ctx->node_chain[i] = c;
+    }
+    
+    /* The rows go where ctx_copy_row would have put them */
+    ctx->lo = h.lo;
+    for (int i = h.lo; i <= h.cell; i++)
+    {
+        row_t *row = m->rows[i] = ctx->ring[i % ctx->ring_size];
+        int this_row_len = min(i+1, m->w);
+        
+        row->offset = i+1 - this_row_len;
+        for (int j=0; j < this_row_len; j++)
+            if (!checkpoint_read_num(&io, row->entries[j].ov)
+                || !checkpoint_read_num(&io, row->entries[j].bv))
+                return false;
+    }
+    
+    /* The checksum must match, and be the very end of the file */
+    uint64_t sum;
+    if (fread(&sum, sizeof sum, 1, f) != 1 || sum != io.sum || fgetc(f) != EOF)
+        return false;
+    
+    m->min_changed = h.min_changed;
+    ctx->edges_decided = h.edges_decided;
+    *cell = h.cell;
+    return true;
+}
+
+/* Carry on an unranking from a checkpoint saved by maze_ctx_checkpoint,
+putting the maze in 'out', which must be the same size as the
+context's grid. The result is as for maze_ctx_unrank, except that
+MAZE_INVALID (with errno set) means the file could not be read, or
+is not a checkpoint for this grid. */
+maze_status maze_ctx_resume(maze_ctx_t *ctx, const char *path, maze_t *out)
+{
+    assert(out->width == ctx->width && out->height == ctx->height);
+    
+    int cell;
+    ctx_reset(ctx);
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return MAZE_INVALID;
+    
+    bool ok = ctx_read_checkpoint(ctx, f, out, &cell);
+    fclose(f);
+    if (!ok) {
+        ctx_reset(ctx);
+        errno = EINVAL;
+        return MAZE_INVALID;
+    }
+    
+    return ctx_finish_unrank(ctx, out, cell);
+}
 
-    matrix_free(m);
-    chain_free(node_chain);
+/* Return the 'index_in'th maze on a 'width'x'height' grid.
+
+If index_in is out of range, returns NULL. (The quickest way
+to find out the allowed range is to use the Fast Maze Counter
+defined in fmc.c)
+
+If you want several mazes of the same size, it is much quicker
+to prepare a context with maze_ctx_new and use maze_ctx_unrank. */
+maze_t *maze_by_index(int width, int height, mpz_t index_in)
+{
+    maze_ctx_t *ctx = maze_ctx_new(width, height);
+    maze_t *maze = maze_init(width, height);
+    maze_status status = maze_ctx_unrank(ctx, index_in, maze);
+    
+    maze_ctx_free(ctx);
     
-    if (mpz_cmp_ui(index, 0) != 0) {
-        mpz_clear(index);
+    if (status != MAZE_OK) {
+        maze_free(maze);
         return 0; /* Index out of range */
     }
     
-    mpz_clear(index);
     return maze;
 }
@@ -31,6 +31,52 @@ typedef struct {
     direction conn[]; /* has (width * height) elements */
 } maze_t;
 
+/* Threading: the library keeps no global mutable state, so any of
+   these functions may be called concurrently from several threads,
+   as long as no two threads are using the same maze_t at once.
+
+   A maze_t belongs to whoever asked for it: the caller of maze_init
+   or maze_by_index must eventually pass it to maze_free.
+
+   A maze_ctx_t holds the prepared state for one grid size, and is
+   modified by every unranking, so each thread needs its own.
+   Contexts loaded from the same file by maze_ctx_load share the
+   file's read-only mapping, even across processes. */
+
+typedef enum {
+    MAZE_OK = 0,
+    MAZE_OUT_OF_RANGE,
+    MAZE_INVALID,
+    MAZE_CANCELLED
+} maze_status;
+
+typedef struct maze_ctx maze_ctx_t;
+
+/* How far a descent has got, as reported to a progress function */
+typedef struct {
+    int cell;           /* The cell whose edges are about to be decided */
+    int num_cells;      /* Cells are decided from num_cells - 1 down to 1 */
+    long edges_decided;
+    long num_edges;
+    double elapsed;     /* Seconds since this call began */
+    double eta;         /* Estimated seconds to go, or -1 if not known yet */
+} maze_progress_t;
+
+/* Called before each cell; returning nonzero cancels the descent */
+typedef int (*maze_progress_fn)(const maze_progress_t *progress, void *arg);
+
+maze_t *maze_init(int width, int height);
 maze_t *maze_by_index(int width, int height, mpz_t index);
 void maze_free(maze_t *maze);
 void maze_print(maze_t *maze);
+void maze_fprint(FILE *out, maze_t *maze);
+
+maze_ctx_t *maze_ctx_new(int width, int height);
+void maze_ctx_free(maze_ctx_t *ctx);
+maze_status maze_ctx_unrank(maze_ctx_t *ctx, mpz_t index, maze_t *out);
+maze_status maze_ctx_rank(maze_ctx_t *ctx, maze_t *maze, mpz_t index);
+void maze_ctx_set_progress(maze_ctx_t *ctx, maze_progress_fn fn, void *arg);
+int maze_ctx_checkpoint(maze_ctx_t *ctx, maze_t *maze, const char *path);
+maze_status maze_ctx_resume(maze_ctx_t *ctx, const char *path, maze_t *out);
+int maze_ctx_save(maze_ctx_t *ctx, const char *path);
+maze_ctx_t *maze_ctx_load(const char *path);
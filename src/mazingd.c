@@ -0,0 +1,528 @@
+/* mazingd.c - A server that keeps prepared contexts warm
+
+mazingd listens on a Unix socket for the requests described in
+mazingd_protocol.h. Preparing a context for a grid size is the
+expensive part of unranking or ranking a maze, so the server keeps
+the contexts it has prepared, for up to a fixed number of the most
+recently used sizes. The requests waiting for a size are handed to the
+worker threads in batches, each of which a worker processes using one
+context. A batch is no more than a fair share of the requests waiting,
+so that the rest are left for the other workers, and one busy size can
+keep them all busy.
+
+Each client connection has a thread of its own, which reads a request,
+hands it to the workers if it needs a context, waits for the answer
+and writes it back.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <sysexits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <gmp.h>
+
+#include "mazing.h"
+#include "fmc.h"
+#include "mazingd_protocol.h"
+
+/* The most requests a worker will take on in one go */
+#define MAX_BATCH 64
+
+
+/** Jobs and sizes **/
+
+/* A request that needs a context, waiting to be processed */
+typedef struct job {
+    struct job *next;
+    int op;             /* MAZINGD_UNRANK, MAZINGD_RANK or MAZINGD_RENDER */
+    mpz_t index;        /* Input when unranking, output when ranking */
+    maze_t *maze;       /* Output when unranking, input when ranking */
+    maze_status status;
+    bool done;
+    pthread_cond_t done_cond;
+} job_t;
+
+/* Everything the server knows about one grid size */
+typedef struct size_entry {
+    int width, height;
+    job_t *jobs, **jobs_tail;   /* Jobs waiting for a worker */
+    int num_jobs;
+    bool queued;                /* Is it on the ready queue? */
+    int busy;                   /* Number of workers processing its jobs */
+    maze_ctx_t **idle;          /* Prepared contexts not in use */
+    int num_idle, idle_capacity;
+    struct size_entry *lru_prev, *lru_next;  /* Most recently used first */
+    struct size_entry *ready_next;
+} size_entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* Signalled when a size joins the ready queue */
+    int num_workers;
+    size_entry_t *lru_head, *lru_tail;
+    int num_sizes, max_sizes;
+    size_entry_t *ready_head, *ready_tail;
+    const char *state_dir;      /* Where to keep prepared state files, if anywhere */
+    fmc_store_t *counts;        /* Count store, if any */
+} server_t;
+
+static void lru_unlink(server_t *s, size_entry_t *e)
+{
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next; else s->lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev; else s->lru_tail = e->lru_prev;
+}
+
+static void lru_push_front(server_t *s, size_entry_t *e)
+{
+    e->lru_prev = 0;
+    e->lru_next = s->lru_head;
+    if (s->lru_head) s->lru_head->lru_prev = e; else s->lru_tail = e;
+    s->lru_head = e;
+}
+
+/* Forget the least recently used sizes that nobody is using, other
+than 'keep' (which may be NULL), until there are no more than max_sizes.
+If they are all in use there may be more for a while. Call with the
+lock held. */
+static void evict_sizes(server_t *s, size_entry_t *keep)
+{
+    size_entry_t *e = s->lru_tail;
+    while (s->num_sizes > s->max_sizes && e)
+    {
+        size_entry_t *prev = e->lru_prev;
+        if (e != keep && !e->jobs && !e->queued && e->busy == 0)
+        {
+            lru_unlink(s, e);
+            for (int i = 0; i < e->num_idle; i++)
+                maze_ctx_free(e->idle[i]);
+            free(e->idle);
+            free(e);
+            s->num_sizes--;
+        }
+        e = prev;
+    }
+}
+
+/* Find the entry for a size, creating it if necessary, and make it the
+most recently used. Call with the lock held. */
+static size_entry_t *find_size(server_t *s, int width, int height)
+{
+    size_entry_t *e;
+    for (e = s->lru_head; e; e = e->lru_next)
+        if (e->width == width && e->height == height)
+            break;
+
+    if (e)
+        lru_unlink(s, e);
+    else
+    {
+        e = calloc(1, sizeof(size_entry_t));
+        e->width = width;
+        e->height = height;
+        e->jobs_tail = &e->jobs;
+        s->num_sizes++;
+    }
+
+    lru_push_front(s, e);
+    evict_sizes(s, e);
+    return e;
+}
+
+/* Put an entry on the ready queue. Call with the lock held. */
+static void make_ready(server_t *s, size_entry_t *e)
+{
+    e->queued = true;
+    e->ready_next = 0;
+    if (s->ready_tail) s->ready_tail->ready_next = e; else s->ready_head = e;
+    s->ready_tail = e;
+    pthread_cond_signal(&s->work);
+}
+
+/* Hand a job to the workers and wait until it's done */
+static void submit(server_t *s, int width, int height, job_t *job)
+{
+    job->next = 0;
+    job->done = false;
+    pthread_cond_init(&job->done_cond, 0);
+
+    pthread_mutex_lock(&s->lock);
+    size_entry_t *e = find_size(s, width, height);
+    *e->jobs_tail = job;
+    e->jobs_tail = &job->next;
+    e->num_jobs++;
+    if (!e->queued)
+        make_ready(s, e);
+
+    while (!job->done)
+        pthread_cond_wait(&job->done_cond, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_cond_destroy(&job->done_cond);
+}
+
+
+/** Workers **/
+
+/* Make a context for a size, from a state file if we have one */
+static maze_ctx_t *prepare(server_t *s, int width, int height)
+{
+    if (!s->state_dir)
+        return maze_ctx_new(width, height);
+
+    char *path = malloc(strlen(s->state_dir) + 64);
+    sprintf(path, "%s/mazing-%dx%d.state", s->state_dir, width, height);
+
+    maze_ctx_t *ctx = maze_ctx_load(path);
+    if (!ctx)
+    {
+        ctx = maze_ctx_new(width, height);
+        if (maze_ctx_save(ctx, path) != 0)
+            perror(path);
+    }
+
+    free(path);
+    return ctx;
+}
+
+static void process(maze_ctx_t *ctx, job_t *job)
+{
+    if (job->op == MAZINGD_RANK)
+        job->status = maze_ctx_rank(ctx, job->maze, job->index);
+    else
+        job->status = maze_ctx_unrank(ctx, job->index, job->maze);
+}
+
+static void *worker(void *arg)
+{
+    server_t *s = arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&s->lock);
+        while (!s->ready_head)
+            pthread_cond_wait(&s->work, &s->lock);
+
+        /* Take the first waiting size off the queue, with our share of its
+        jobs, leaving enough for each of the other workers to take as many.
+        If any are left, the size goes back on the queue, which wakes the
+        next worker, if one is waiting, to take its share. */
+        size_entry_t *e = s->ready_head;
+        s->ready_head = e->ready_next;
+        if (!s->ready_head) s->ready_tail = 0;
+        e->queued = false;
+
+        int share = (e->num_jobs + s->num_workers - 1) / s->num_workers, n = 1;
+        if (share > MAX_BATCH) share = MAX_BATCH;
+
+        job_t *batch = e->jobs, *last = batch;
+        for (; n < share && last->next; n++)
+            last = last->next;
+        e->jobs = last->next;
+        e->num_jobs -= n;
+        last->next = 0;
+        if (e->jobs)
+            make_ready(s, e);
+        else
+            e->jobs_tail = &e->jobs;
+
+        e->busy++;
+        maze_ctx_t *ctx = e->num_idle > 0 ? e->idle[--e->num_idle] : 0;
+        pthread_mutex_unlock(&s->lock);
+
+        if (!ctx)
+            ctx = prepare(s, e->width, e->height);
+
+        while (batch)
+        {
+            job_t *job = batch;
+            batch = job->next;
+            process(ctx, job);
+
+            pthread_mutex_lock(&s->lock);
+            job->done = true;
+            pthread_cond_signal(&job->done_cond);
+            pthread_mutex_unlock(&s->lock);
+        }
+
+        pthread_mutex_lock(&s->lock);
+        if (e->num_idle == e->idle_capacity)
+        {
+            e->idle_capacity = e->idle_capacity ? 2 * e->idle_capacity : 4;
+            e->idle = realloc(e->idle, sizeof(maze_ctx_t *) * e->idle_capacity);
+        }
+        e->idle[e->num_idle++] = ctx;
+        e->busy--;
+        evict_sizes(s, 0);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    return 0;
+}
+
+
+/** Connections **/
+
+typedef struct {
+    server_t *server;
+    int fd;
+} connection_t;
+
+static int respond(int fd, uint32_t status, const void *payload, size_t length)
+{
+    mazingd_response_t response;
+    response.status = status;
+    response.length = length;
+
+    if (mazingd_write_full(fd, &response, sizeof response) != 0)
+        return -1;
+    return length ? mazingd_write_full(fd, payload, length) : 0;
+}
+
+static uint32_t status_code(maze_status status)
+{
+    switch (status)
+    {
+        case MAZE_OK: return MAZINGD_OK;
+        case MAZE_OUT_OF_RANGE: return MAZINGD_OUT_OF_RANGE;
+        case MAZE_INVALID: return MAZINGD_INVALID;
+        case MAZE_CANCELLED: break;
+    }
+    return MAZINGD_ERROR;
+}
+
+/* Deal with one request whose header and payload have been read.
+Returns -1 if the connection should be closed. */
+static int handle(server_t *s, int fd, mazingd_request_t *req, char *payload)
+{
+    int w = req->width, h = req->height, result;
+    size_t len;
+    char *out;
+    job_t job;
+
+    if (req->width == 0 || req->height == 0
+        || (uint64_t) req->width * req->height > MAZINGD_MAX_CELLS)
+        return respond(fd, MAZINGD_BAD_REQUEST, 0, 0);
+
+    if (req->op != MAZINGD_COUNT
+        && (uint64_t) req->width * req->height * (req->width + 1) > MAZINGD_MAX_BAND)
+        return respond(fd, MAZINGD_BAD_REQUEST, 0, 0);
+
+    switch (req->op)
+    {
+        case MAZINGD_COUNT:
+        {
+            /* The count is the same either way round, and fmc is
+            much quicker with the smaller side as the width */
+            uint64_t lo = w < h ? w : h, hi = w < h ? h : w;
+            if (lo * lo * lo * hi > MAZINGD_MAX_COUNT_COST)
+                return respond(fd, MAZINGD_BAD_REQUEST, 0, 0);
+
+            mpz_t count;
+            mpz_init(count);
+            fmc_cached(s->counts, &count, lo, hi);
+            out = mazingd_export(count, &len);
+            result = respond(fd, MAZINGD_OK, out, len);
+            free(out);
+            mpz_clear(count);
+            return result;
+        }
+
+        case MAZINGD_UNRANK:
+        case MAZINGD_RENDER:
+            job.op = req->op;
+            mpz_init(job.index);
+            mazingd_import(job.index, payload, req->length);
+            job.maze = maze_init(w, h);
+            submit(s, w, h, &job);
+
+            if (job.status != MAZE_OK)
+                result = respond(fd, status_code(job.status), 0, 0);
+            else if (req->op == MAZINGD_UNRANK)
+                result = respond(fd, MAZINGD_OK, job.maze->conn, (size_t) w * h);
+            else
+            {
+                FILE *f = open_memstream(&out, &len);
+                maze_fprint(f, job.maze);
+                fclose(f);
+                result = respond(fd, MAZINGD_OK, out, len);
+                free(out);
+            }
+
+            maze_free(job.maze);
+            mpz_clear(job.index);
+            return result;
+
+        case MAZINGD_RANK:
+            if (req->length != (uint64_t) w * h)
+                return respond(fd, MAZINGD_BAD_REQUEST, 0, 0);
+
+            job.op = req->op;
+            mpz_init(job.index);
+            job.maze = maze_init(w, h);
+            memcpy(job.maze->conn, payload, (size_t) w * h);
+            submit(s, w, h, &job);
+
+            if (job.status != MAZE_OK)
+                result = respond(fd, status_code(job.status), 0, 0);
+            else
+            {
+                out = mazingd_export(job.index, &len);
+                result = respond(fd, MAZINGD_OK, out, len);
+                free(out);
+            }
+
+            maze_free(job.maze);
+            mpz_clear(job.index);
+            return result;
+    }
+
+    return respond(fd, MAZINGD_BAD_REQUEST, 0, 0);
+}
+
+static void *connection(void *arg)
+{
+    connection_t *c = arg;
+    mazingd_request_t req;
+    char *payload = 0;
+
+    while (mazingd_read_full(c->fd, &req, sizeof req) == 0)
+    {
+        if (req.length > MAZINGD_MAX_PAYLOAD)
+        {
+            /* We can't skip that much, so give up on this client */
+            respond(c->fd, MAZINGD_BAD_REQUEST, 0, 0);
+            break;
+        }
+
+        payload = realloc(payload, req.length + 1);
+        if (mazingd_read_full(c->fd, payload, req.length) != 0
+            || handle(c->server, c->fd, &req, payload) != 0)
+            break;
+    }
+
+    free(payload);
+    close(c->fd);
+    free(c);
+    return 0;
+}
+
+
+/** Starting up **/
+
+static const char *socket_path = "/tmp/mazingd.sock";
+
+static void on_signal(int sig)
+{
+    unlink(socket_path);
+    _exit(128 + sig);
+}
+
+static void usage(char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-s socket] [-t threads] [-l max_sizes] [-p state_dir] [-c count_store]\n",
+        argv0);
+}
+
+int main(int argc, char **argv)
+{
+    server_t s;
+    int num_threads = 0, opt;
+    const char *count_path = getenv("MAZING_COUNTS");
+
+    memset(&s, 0, sizeof s);
+    s.max_sizes = 8;
+
+    while ((opt = getopt(argc, argv, "s:t:l:p:c:")) != -1)
+    {
+        switch (opt)
+        {
+            case 's': socket_path = optarg; break;
+            case 't': num_threads = atoi(optarg); break;
+            case 'l': s.max_sizes = atoi(optarg); break;
+            case 'p': s.state_dir = optarg; break;
+            case 'c': count_path = optarg; break;
+            default:
+                usage(argv[0]);
+                return EX_USAGE;
+        }
+    }
+    if (optind != argc || s.max_sizes < 1)
+    {
+        usage(argv[0]);
+        return EX_USAGE;
+    }
+    if (num_threads < 1)
+    {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = n > 0 ? (int) n : 1;
+    }
+    s.num_workers = num_threads;
+
+    if (count_path && *count_path)
+    {
+        s.counts = fmc_store_open(count_path, FMC_STORE_DEFAULT_MAX_DIM);
+        if (!s.counts)
+            perror(count_path);
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof addr.sun_path)
+    {
+        fprintf(stderr, "%s: socket path too long\n", socket_path);
+        return EX_USAGE;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if (listener < 0 || bind(listener, (struct sockaddr *) &addr, sizeof addr) != 0
+        || listen(listener, 128) != 0)
+    {
+        perror(socket_path);
+        return EX_OSERR;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    pthread_mutex_init(&s.lock, 0);
+    pthread_cond_init(&s.work, 0);
+    for (int t = 0; t < num_threads; t++)
+    {
+        pthread_t thread;
+        pthread_create(&thread, 0, worker, &s);
+        pthread_detach(thread);
+    }
+
+    for (;;)
+    {
+        int fd = accept(listener, 0, 0);
+        if (fd < 0)
+            continue;
+
+        connection_t *c = malloc(sizeof(connection_t));
+        c->server = &s;
+        c->fd = fd;
+
+        pthread_t thread;
+        if (pthread_create(&thread, 0, connection, c) != 0)
+        {
+            close(fd);
+            free(c);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
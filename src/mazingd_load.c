@@ -0,0 +1,307 @@
+/* mazingd_load.c - A load generator for mazingd
+
+Opens a number of connections to the server, sends requests for
+random mazes of one size over each of them as fast as the server
+will answer, and reports the throughput and the latency percentiles.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <gmp.h>
+
+#include "mazingd_protocol.h"
+#include "timing.h"
+
+/* How many different mazes to send when benchmarking MAZINGD_RANK */
+#define NUM_RANK_MAZES 64
+
+
+/** Talking to the server **/
+
+static int connect_to(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof addr.sun_path - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof addr) != 0)
+    {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Send a request and read the response, whose payload is stored in
+*buf (which is grown as necessary). Returns the status, or -1 if the
+connection failed. */
+static int call(int fd, uint32_t op, int width, int height, const void *payload, size_t length,
+    char **buf, size_t *buf_size, size_t *out_length)
+{
+    mazingd_request_t req;
+    mazingd_response_t res;
+    req.op = op;
+    req.width = width;
+    req.height = height;
+    req.length = length;
+
+    if (mazingd_write_full(fd, &req, sizeof req) != 0
+        || (length && mazingd_write_full(fd, payload, length) != 0)
+        || mazingd_read_full(fd, &res, sizeof res) != 0
+        || res.length > MAZINGD_MAX_PAYLOAD)
+        return -1;
+
+    if (res.length > *buf_size)
+    {
+        *buf_size = res.length;
+        *buf = realloc(*buf, *buf_size);
+    }
+    if (mazingd_read_full(fd, *buf, res.length) != 0)
+        return -1;
+
+    *out_length = res.length;
+    return res.status;
+}
+
+
+/** The load **/
+
+typedef struct {
+    const char *socket_path;
+    uint32_t op;
+    int width, height;
+    mpz_t count;                /* Number of mazes of this size */
+    char *rank_mazes;           /* NUM_RANK_MAZES mazes to rank, one after another */
+} load_t;
+
+typedef struct {
+    load_t *load;
+    pthread_t thread;
+    int num_requests;
+    double *latencies;          /* Seconds taken by each request */
+    int errors;
+    unsigned long seed;
+} client_t;
+
+static void *client(void *arg)
+{
+    client_t *c = arg;
+    load_t *load = c->load;
+    size_t cells = (size_t) load->width * load->height;
+    char *buf = 0;
+    size_t buf_size = 0, length;
+    gmp_randstate_t rand;
+    mpz_t index;
+
+    int fd = connect_to(load->socket_path);
+    if (fd < 0)
+    {
+        c->errors = c->num_requests;
+        c->num_requests = 0;
+        return 0;
+    }
+
+    gmp_randinit_default(rand);
+    gmp_randseed_ui(rand, c->seed);
+    mpz_init(index);
+
+    for (int i = 0; i < c->num_requests; i++)
+    {
+        void *payload = 0;
+        size_t payload_length = 0;
+
+        if (load->op == MAZINGD_RANK)
+        {
+            payload = load->rank_mazes + cells * (i % NUM_RANK_MAZES);
+            payload_length = cells;
+        }
+        else if (load->op != MAZINGD_COUNT)
+        {
+            mpz_urandomm(index, rand, load->count);
+            payload = mazingd_export(index, &payload_length);
+        }
+
+        double start = mazing_timing_now();
+        int status = call(fd, load->op, load->width, load->height, payload, payload_length,
+            &buf, &buf_size, &length);
+        c->latencies[i] = mazing_timing_now() - start;
+
+        if (load->op != MAZINGD_RANK)
+            free(payload);
+        if (status < 0)
+        {
+            c->errors += c->num_requests - i;
+            c->num_requests = i;
+            break;
+        }
+        if (status != MAZINGD_OK)
+            c->errors++;
+    }
+
+    mpz_clear(index);
+    gmp_randclear(rand);
+    free(buf);
+    close(fd);
+    return 0;
+}
+
+/* Ask the server how many mazes there are, and, if we're going to be
+ranking, for some mazes to rank. Returns 0 on success. */
+static int set_up(load_t *load)
+{
+    size_t cells = (size_t) load->width * load->height, buf_size = 0, length;
+    char *buf = 0;
+    int fd = connect_to(load->socket_path), result = -1;
+    if (fd < 0)
+        return -1;
+
+    if (call(fd, MAZINGD_COUNT, load->width, load->height, 0, 0, &buf, &buf_size, &length) != MAZINGD_OK)
+        goto done;
+    mazingd_import(load->count, buf, length);
+
+    if (load->op == MAZINGD_RANK)
+    {
+        gmp_randstate_t rand;
+        mpz_t index;
+        gmp_randinit_default(rand);
+        mpz_init(index);
+
+        load->rank_mazes = malloc(cells * NUM_RANK_MAZES);
+        for (int i = 0; i < NUM_RANK_MAZES; i++)
+        {
+            mpz_urandomm(index, rand, load->count);
+            size_t index_length;
+            void *payload = mazingd_export(index, &index_length);
+            int status = call(fd, MAZINGD_UNRANK, load->width, load->height, payload, index_length,
+                &buf, &buf_size, &length);
+            free(payload);
+            if (status != MAZINGD_OK || length != cells)
+                break;
+            memcpy(load->rank_mazes + cells * i, buf, cells);
+            if (i == NUM_RANK_MAZES - 1)
+                result = 0;
+        }
+
+        mpz_clear(index);
+        gmp_randclear(rand);
+    }
+    else
+        result = 0;
+
+done:
+    if (result != 0)
+        fprintf(stderr, "The server couldn't give us a %dx%d maze\n", load->width, load->height);
+    free(buf);
+    close(fd);
+    return result;
+}
+
+
+/** Reporting **/
+
+static void usage(char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-s socket] [-c connections] [-n requests] "
+                    "[-o count|unrank|rank|render] width height\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+    load_t load;
+    int num_clients = 4, num_requests = 1000, opt;
+
+    memset(&load, 0, sizeof load);
+    load.socket_path = "/tmp/mazingd.sock";
+    load.op = MAZINGD_UNRANK;
+
+    while ((opt = getopt(argc, argv, "s:c:n:o:")) != -1)
+    {
+        switch (opt)
+        {
+            case 's': load.socket_path = optarg; break;
+            case 'c': num_clients = atoi(optarg); break;
+            case 'n': num_requests = atoi(optarg); break;
+            case 'o':
+                if (strcmp(optarg, "count") == 0) load.op = MAZINGD_COUNT;
+                else if (strcmp(optarg, "unrank") == 0) load.op = MAZINGD_UNRANK;
+                else if (strcmp(optarg, "rank") == 0) load.op = MAZINGD_RANK;
+                else if (strcmp(optarg, "render") == 0) load.op = MAZINGD_RENDER;
+                else { usage(argv[0]); return EX_USAGE; }
+                break;
+            default:
+                usage(argv[0]);
+                return EX_USAGE;
+        }
+    }
+    if (optind + 2 != argc || num_clients < 1 || num_requests < 1)
+    {
+        usage(argv[0]);
+        return EX_USAGE;
+    }
+    load.width = atoi(argv[optind]);
+    load.height = atoi(argv[optind + 1]);
+    if (load.width < 1 || load.height < 1)
+    {
+        usage(argv[0]);
+        return EX_USAGE;
+    }
+
+    mpz_init(load.count);
+    if (set_up(&load) != 0)
+        return EX_UNAVAILABLE;
+
+    client_t *clients = calloc(num_clients, sizeof(client_t));
+    double *latencies = malloc(sizeof(double) * num_requests);
+    double *next = latencies;
+
+    double start = mazing_timing_now();
+    for (int i = 0; i < num_clients; i++)
+    {
+        clients[i].load = &load;
+        clients[i].num_requests = num_requests / num_clients + (i < num_requests % num_clients);
+        clients[i].latencies = next;
+        clients[i].seed = i + 1;
+        next += clients[i].num_requests;
+        pthread_create(&clients[i].thread, 0, client, &clients[i]);
+    }
+
+    int done = 0, errors = 0;
+    for (int i = 0; i < num_clients; i++)
+    {
+        pthread_join(clients[i].thread, 0);
+        /* Gather up the latencies of the requests that were answered */
+        memmove(latencies + done, clients[i].latencies, sizeof(double) * clients[i].num_requests);
+        done += clients[i].num_requests;
+        errors += clients[i].errors;
+    }
+    double elapsed = mazing_timing_now() - start;
+
+    mazing_timing_sort(latencies, done);
+    printf("%d requests (%d errors) on %d connections in %.3fs: %.1f requests/s\n",
+        done, errors, num_clients, elapsed, done / elapsed);
+    if (done > 0)
+        printf("latency (ms): p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+            1e3 * mazing_timing_quantile(latencies, done, 0.5),
+            1e3 * mazing_timing_quantile(latencies, done, 0.9),
+            1e3 * mazing_timing_quantile(latencies, done, 0.99),
+            1e3 * mazing_timing_quantile(latencies, done, 0.999),
+            1e3 * latencies[done - 1]);
+
+    free(latencies);
+    free(clients);
+    free(load.rank_mazes);
+    mpz_clear(load.count);
+    return errors ? EX_SOFTWARE : 0;
+}
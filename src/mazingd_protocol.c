@@ -0,0 +1,61 @@
+/* mazingd_protocol.c - Helpers shared by mazingd and its clients */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <gmp.h>
+#include "mazingd_protocol.h"
+
+/* Read exactly 'len' bytes from 'fd'.
+Returns 0 on success, or -1 on error or end of file. */
+int mazingd_read_full(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len > 0)
+    {
+        ssize_t r = read(fd, p, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+/* Write exactly 'len' bytes to 'fd'.
+Returns 0 on success, or -1 on error. */
+int mazingd_write_full(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0)
+    {
+        ssize_t r = write(fd, p, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+/* The magnitude of 'x' as a newly-allocated little-endian byte string,
+whose length is stored in *len. (Never NULL, even if *len is 0.) */
+void *mazingd_export(mpz_t x, size_t *len)
+{
+    void *buf = malloc((mpz_sizeinbase(x, 2) + 7) / 8 + 1);
+    mpz_export(buf, len, -1, 1, 0, 0, x);
+    return buf;
+}
+
+/* Set 'x' from a little-endian byte string */
+void mazingd_import(mpz_t x, const void *buf, size_t len)
+{
+    mpz_import(x, len, -1, 1, 0, 0, buf);
+}
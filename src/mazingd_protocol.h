@@ -0,0 +1,64 @@
+/* The protocol spoken by mazingd over its Unix socket.
+
+A client sends requests, each of which is a mazingd_request_t followed
+by 'length' bytes of payload, and the server answers each one, in order,
+with a mazingd_response_t followed by 'length' bytes of payload. Since
+the socket is local, the headers are in the native byte order.
+
+Numbers (counts and indices) are sent as unsigned little-endian byte
+strings, with zero being the empty string. Mazes are sent as the
+(width * height) bytes of maze_t's 'conn' array.
+
+    op              request payload     response payload
+    MAZINGD_COUNT   (none)              number of mazes
+    MAZINGD_UNRANK  index               maze
+    MAZINGD_RANK    maze                index
+    MAZINGD_RENDER  index               the maze drawn as by maze_print
+*/
+
+#define MAZINGD_COUNT  1
+#define MAZINGD_UNRANK 2
+#define MAZINGD_RANK   3
+#define MAZINGD_RENDER 4
+
+#define MAZINGD_OK           0
+#define MAZINGD_OUT_OF_RANGE 1 /* No maze has that index */
+#define MAZINGD_INVALID      2 /* That's not a maze on this grid */
+#define MAZINGD_BAD_REQUEST  3
+#define MAZINGD_ERROR        4 /* Something went wrong in the server */
+
+/* The largest grid the server will count the mazes on, in cells */
+#define MAZINGD_MAX_CELLS (1 << 20)
+
+/* Nor will it count them on a grid whose lo * lo * lo * hi is more
+than this, where lo and hi are its smaller and larger sides. fmc works
+with matrices of side lo - 1, whose entries grow with hi, and the time
+it takes goes up about in proportion to that: a grid at the limit, like
+64x1024 or 16x65536, takes ten seconds or so. This also keeps lo small
+enough for fmc's matrices to fit in memory. */
+#define MAZINGD_MAX_COUNT_COST (1 << 28)
+
+/* The largest grid the server will unrank, rank or render mazes on,
+measured by the number of entries in the band of its matrix, which is
+width * height * (width + 1). Preparing a context takes memory and
+time in proportion to that, and then some, since the numbers grow too. */
+#define MAZINGD_MAX_BAND (1 << 20)
+
+/* The largest payload either side will send */
+#define MAZINGD_MAX_PAYLOAD (1 << 24)
+
+typedef struct {
+    uint32_t op;
+    uint32_t width, height;
+    uint32_t length;
+} mazingd_request_t;
+
+typedef struct {
+    uint32_t status;
+    uint32_t length;
+} mazingd_response_t;
+
+int mazingd_read_full(int fd, void *buf, size_t len);
+int mazingd_write_full(int fd, const void *buf, size_t len);
+void *mazingd_export(mpz_t x, size_t *len);
+void mazingd_import(mpz_t x, const void *buf, size_t len);
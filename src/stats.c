@@ -0,0 +1,132 @@
+/* stats.c - Optional instrumentation of the determinant computations */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gmp.h>
+#include "stats.h"
+#include "counters.h"
+
+#ifdef MAZING_STATS
+
+__thread mazing_stats_t mazing_thread_stats;
+static __thread int row_capacity;
+
+/* Record a try_edge call that had to re-eliminate 'rows' rows */
+void stats_try_edge(int rows)
+{
+    mazing_stats_t *s = &mazing_thread_stats;
+    s->try_edges++;
+    s->rows_reeliminated += rows;
+    if ((unsigned long) rows > s->max_rows_reeliminated)
+        s->max_rows_reeliminated = rows;
+}
+
+/* Start timing the rows of a new maze, 'height' rows high. The times
+add up over successive mazes, unless the height changes. */
+void stats_begin_maze(int height)
+{
+    mazing_stats_t *s = &mazing_thread_stats;
+    if (height > row_capacity)
+    {
+        s->row_seconds = realloc(s->row_seconds, sizeof(double) * height);
+        row_capacity = height;
+    }
+    if (height != s->num_rows)
+    {
+        s->num_rows = height;
+        memset(s->row_seconds, 0, sizeof(double) * height);
+    }
+    s->mazes++;
+}
+
+int mazing_stats_enabled(void) { return 1; }
+
+/* Copy the calling thread's counters to 'out'. The row times are not
+copied: out->row_seconds points at this thread's own array, which
+stays valid until the thread calls mazing_stats_reset. */
+void mazing_stats_get(mazing_stats_t *out)
+{
+    *out = mazing_thread_stats;
+}
+
+/* Set the calling thread's counters back to zero, and free its row
+times. A thread that has unranked mazes should call this before it
+exits, or the row times are leaked. */
+void mazing_stats_reset(void)
+{
+    free(mazing_thread_stats.row_seconds);
+    memset(&mazing_thread_stats, 0, sizeof mazing_thread_stats);
+    row_capacity = 0;
+}
+
+#else
+
+int mazing_stats_enabled(void) { return 0; }
+
+void mazing_stats_get(mazing_stats_t *out)
+{
+    memset(out, 0, sizeof *out);
+}
+
+void mazing_stats_reset(void) {}
+
+#endif
+
+static void add_op(mazing_op_stats_t *total, const mazing_op_stats_t *op)
+{
+    total->calls += op->calls;
+    total->muls += op->muls;
+    total->submuls += op->submuls;
+    total->divexacts += op->divexacts;
+    total->limbs += op->limbs;
+}
+
+/* Add the counters in 'stats' to those in 'total', e.g. to combine the
+counters of several threads. The row times are added too, if 'total'
+has room for them: it's up to the caller to provide that. */
+void mazing_stats_add(mazing_stats_t *total, const mazing_stats_t *stats)
+{
+    add_op(&total->det_init, &stats->det_init);
+    add_op(&total->det_update, &stats->det_update);
+    add_op(&total->bareiss, &stats->bareiss);
+    total->try_edges += stats->try_edges;
+    total->rows_reeliminated += stats->rows_reeliminated;
+    if (stats->max_rows_reeliminated > total->max_rows_reeliminated)
+        total->max_rows_reeliminated = stats->max_rows_reeliminated;
+    total->mazes += stats->mazes;
+    
+    if (total->row_seconds && stats->row_seconds)
+        for (int y = 0; y < total->num_rows && y < stats->num_rows; y++)
+            total->row_seconds[y] += stats->row_seconds[y];
+}
+
+static void print_op(FILE *out, const char *name, const mazing_op_stats_t *op)
+{
+    unsigned long c = op->calls ? op->calls : 1;
+    fprintf(out, "%-10s %10lu calls  %12lu muls  %12lu submuls  %12lu divexacts  %14lu limbs"
+                 "  (%.1f limbs/call)\n",
+        name, op->calls, op->muls, op->submuls, op->divexacts, op->limbs, (double) op->limbs / c);
+}
+
+/* Print the counters to 'out', in a form meant for people to read */
+void mazing_stats_print(FILE *out, const mazing_stats_t *stats)
+{
+    print_op(out, "det_init", &stats->det_init);
+    print_op(out, "det_update", &stats->det_update);
+    print_op(out, "bareiss", &stats->bareiss);
+    
+    fprintf(out, "try_edge   %10lu calls  %12lu rows re-eliminated  (%.1f/call, max %lu)\n",
+        stats->try_edges, stats->rows_reeliminated,
+        (double) stats->rows_reeliminated / (stats->try_edges ? stats->try_edges : 1),
+        stats->max_rows_reeliminated);
+    
+    if (stats->row_seconds && stats->num_rows > 0)
+    {
+        fprintf(out, "seconds per maze row, over %lu maze(s), from the top:\n", stats->mazes);
+        for (int y = 0; y < stats->num_rows; y++)
+            fprintf(out, "  %4d %12.6f\n", y, stats->row_seconds[y]);
+    }
+}
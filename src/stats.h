@@ -0,0 +1,31 @@
+/* Optional instrumentation of the determinant computations.
+
+The counters are only kept if the library was built with MAZING_STATS
+defined (cmake -DMAZING_STATS=ON); otherwise they always read as zero,
+and the code that would update them is not compiled at all.
+
+Each thread has its own counters, so these functions only ever see
+the work done by the thread that calls them. */
+
+/* Counters for one of the determinant routines */
+typedef struct {
+    unsigned long calls;
+    unsigned long muls, submuls, divexacts;
+    unsigned long limbs; /* Total size of the operands of those operations */
+} mazing_op_stats_t;
+
+typedef struct {
+    mazing_op_stats_t det_init, det_update, bareiss;
+    unsigned long try_edges;            /* Calls that needed a determinant */
+    unsigned long rows_reeliminated;    /* Summed over those calls */
+    unsigned long max_rows_reeliminated;
+    unsigned long mazes;                /* Mazes unranked */
+    int num_rows;                       /* Number of entries in row_seconds */
+    double *row_seconds;                /* Wall time spent on each row of the maze */
+} mazing_stats_t;
+
+int mazing_stats_enabled(void);
+void mazing_stats_get(mazing_stats_t *out);
+void mazing_stats_reset(void);
+void mazing_stats_add(mazing_stats_t *total, const mazing_stats_t *stats);
+void mazing_stats_print(FILE *out, const mazing_stats_t *stats);
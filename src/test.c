@@ -0,0 +1,512 @@
+/* test.c - Checks run by ctest
+
+Each check is a subcommand, e.g. "mazing-test rank", which prints what
+went wrong, if anything, and exits with a nonzero status if it did.
+See CMakeLists.txt for how they are run.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <gmp.h>
+
+#include "mazing.h"
+#include "fmc.h"
+#include "mazingd_protocol.h"
+
+/* Grid shapes to try, including the awkward ones */
+static const int shapes[][2] = { {1, 1}, {1, 5}, {5, 1}, {2, 2}, {3, 4}, {4, 3}, {5, 5}, {7, 3} };
+#define NUM_SHAPES ((int) (sizeof shapes / sizeof shapes[0]))
+
+/* How many random indices to try for each shape */
+#define NUM_INDICES 20
+
+static int failures = 0;
+
+static void fail(const char *what, int width, int height, mpz_t index)
+{
+    gmp_fprintf(stderr, "%s: %dx%d, index %Zd\n", what, width, height, index);
+    failures++;
+}
+
+
+/** rank: maze_ctx_rank undoes maze_ctx_unrank **/
+
+static void test_rank(gmp_randstate_t rand)
+{
+    mpz_t count, index, rank;
+    mpz_init(count);
+    mpz_init(index);
+    mpz_init(rank);
+
+    for (int s = 0; s < NUM_SHAPES; s++)
+    {
+        int w = shapes[s][0], h = shapes[s][1];
+        maze_ctx_t *ctx = maze_ctx_new(w, h);
+        maze_t *maze = maze_init(w, h);
+        fmc(&count, w, h);
+
+        for (int k = 0; k < NUM_INDICES; k++)
+        {
+            mpz_urandomm(index, rand, count);
+            if (maze_ctx_unrank(ctx, index, maze) != MAZE_OK)
+                fail("unrank failed", w, h, index);
+            else if (maze_ctx_rank(ctx, maze, rank) != MAZE_OK || mpz_cmp(rank, index) != 0)
+                fail("rank(unrank(i)) != i", w, h, index);
+        }
+
+        /* A grid with every wall knocked down is not a maze, unless it's a line */
+        for (int i = 0; i < w * h; i++)
+            maze->conn[i] = (i % w ? DIR_W : 0) | (i % w < w - 1 ? DIR_E : 0)
+                          | (i >= w ? DIR_N : 0) | (i < w * (h-1) ? DIR_S : 0);
+        if ((w > 1 && h > 1) != (maze_ctx_rank(ctx, maze, rank) == MAZE_INVALID))
+            fail("open grid ranked wrongly", w, h, count);
+
+        maze_free(maze);
+        maze_ctx_free(ctx);
+    }
+
+    mpz_clear(count);
+    mpz_clear(index);
+    mpz_clear(rank);
+}
+
+
+/** state: a file written by "mazing W H --prepare" gives the same mazes **/
+
+static void test_state(const char *path, int w, int h, gmp_randstate_t rand)
+{
+    mpz_t count, index;
+    mpz_init(count);
+    mpz_init(index);
+
+    maze_ctx_t *loaded = maze_ctx_load(path);
+    if (!loaded)
+    {
+        perror(path);
+        failures++;
+        return;
+    }
+
+    maze_ctx_t *fresh = maze_ctx_new(w, h);
+    maze_t *a = maze_init(w, h), *b = maze_init(w, h);
+    fmc(&count, w, h);
+
+    for (int k = 0; k < NUM_INDICES; k++)
+    {
+        mpz_urandomm(index, rand, count);
+        if (maze_ctx_unrank(loaded, index, a) != MAZE_OK
+            || maze_ctx_unrank(fresh, index, b) != MAZE_OK
+            || memcmp(a->conn, b->conn, w * h) != 0)
+            fail("loaded state gives a different maze", w, h, index);
+    }
+
+    maze_free(a);
+    maze_free(b);
+    maze_ctx_free(fresh);
+    maze_ctx_free(loaded);
+    mpz_clear(count);
+    mpz_clear(index);
+}
+
+
+/** store: counts put in a count store come back out, after reopening it **/
+
+static void test_store(const char *path)
+{
+    mpz_t count, stored;
+    mpz_init(count);
+    mpz_init(stored);
+    remove(path);
+
+    fmc_store_t *store = fmc_store_open(path, 8);
+    if (!store || fmc_store_fill(store, 8, 8, 2) != 0)
+    {
+        perror(path);
+        failures++;
+        return;
+    }
+    fmc_store_close(store);
+
+    store = fmc_store_open(path, 8);
+    for (int w = 1; w <= 8; w++)
+        for (int h = 1; h <= 8; h++)
+        {
+            fmc(&count, w, h);
+            if (!fmc_store_get(store, &stored, w, h) || mpz_cmp(stored, count) != 0)
+                fail("wrong count in store", w, h, count);
+        }
+    if (fmc_store_get(store, &stored, 9, 1))
+        fail("store has a count it shouldn't", 9, 1, stored);
+
+    fmc_store_close(store);
+    remove(path);
+    mpz_clear(count);
+    mpz_clear(stored);
+}
+
+
+/** checkpoint: stopping, saving and resuming gives the same maze **/
+
+typedef struct {
+    maze_ctx_t *ctx;
+    maze_t *maze;
+    const char *path;
+    int at_cell;    /* Where to do something */
+    int cancel;     /* Cancel there? Otherwise save a checkpoint and carry on */
+    int saved;
+} checkpoint_test_t;
+
+static int checkpoint_progress(const maze_progress_t *p, void *arg)
+{
+    checkpoint_test_t *t = arg;
+    if (p->cell != t->at_cell)
+        return 0;
+    if (t->cancel)
+        return 1;
+    t->saved = maze_ctx_checkpoint(t->ctx, t->maze, t->path) == 0;
+    return 0;
+}
+
+static void test_checkpoint(const char *path, gmp_randstate_t rand)
+{
+    mpz_t count, index;
+    mpz_init(count);
+    mpz_init(index);
+
+    for (int s = 0; s < NUM_SHAPES; s++)
+    {
+        int w = shapes[s][0], h = shapes[s][1];
+        maze_ctx_t *ctx = maze_ctx_new(w, h), *other = maze_ctx_new(w, h);
+        maze_t *direct = maze_init(w, h), *stopped = maze_init(w, h), *resumed = maze_init(w, h);
+        checkpoint_test_t t = { ctx, stopped, path, 0, 0, 0 };
+        fmc(&count, w, h);
+
+        for (int cell = 1; cell < w * h; cell++)
+        {
+            mpz_urandomm(index, rand, count);
+            maze_ctx_unrank(other, index, direct);
+            t.at_cell = cell;
+            maze_ctx_set_progress(ctx, checkpoint_progress, &t);
+
+            /* Cancel, save and resume */
+            t.cancel = 1;
+            if (maze_ctx_unrank(ctx, index, stopped) != MAZE_CANCELLED
+                || maze_ctx_checkpoint(ctx, stopped, path) != 0)
+                fail("couldn't cancel and save", w, h, index);
+            else if (maze_ctx_resume(other, path, resumed) != MAZE_OK
+                     || memcmp(resumed->conn, direct->conn, w * h) != 0)
+                fail("resumed maze differs", w, h, index);
+
+            /* Save from the progress function, carry on, and resume anyway */
+            t.cancel = 0;
+            t.saved = 0;
+            if (maze_ctx_unrank(ctx, index, stopped) != MAZE_OK || !t.saved
+                || memcmp(stopped->conn, direct->conn, w * h) != 0)
+                fail("couldn't save along the way", w, h, index);
+            else if (maze_ctx_resume(other, path, resumed) != MAZE_OK
+                     || memcmp(resumed->conn, direct->conn, w * h) != 0)
+                fail("maze resumed from along the way differs", w, h, index);
+
+            /* A finished unranking has nothing to save */
+            if (maze_ctx_checkpoint(ctx, stopped, path) == 0)
+                fail("saved a finished unranking", w, h, index);
+        }
+
+        /* A damaged checkpoint is refused */
+        if (w * h > 1)
+        {
+            t.at_cell = 1;
+            t.cancel = 1;
+            maze_ctx_unrank(ctx, index, stopped);
+            maze_ctx_checkpoint(ctx, stopped, path);
+
+            FILE *f = fopen(path, "r+b");
+            fseek(f, 0, SEEK_END);
+            long middle = ftell(f) / 2;
+            fseek(f, middle, SEEK_SET);
+            int c = fgetc(f);
+            fseek(f, middle, SEEK_SET);
+            fputc(c ^ 1, f);
+            fclose(f);
+
+            if (maze_ctx_resume(other, path, resumed) != MAZE_INVALID)
+                fail("damaged checkpoint accepted", w, h, index);
+        }
+
+        maze_free(direct);
+        maze_free(stopped);
+        maze_free(resumed);
+        maze_ctx_free(ctx);
+        maze_ctx_free(other);
+    }
+
+    remove(path);
+    mpz_clear(count);
+    mpz_clear(index);
+}
+
+
+/** batch: "mazing W H --batch" prints what "mazing W H i" would, in order **/
+
+/* Run 'command' with the shell, and return everything it wrote to
+stdout in a newly-allocated string. Its exit status goes in *status. */
+static char *run(const char *command, int *status)
+{
+    size_t length = 0, capacity = 4096;
+    char *out = malloc(capacity);
+    FILE *p = popen(command, "r");
+    if (!p)
+    {
+        perror(command);
+        exit(2);
+    }
+
+    size_t k;
+    while ((k = fread(out + length, 1, capacity - length - 1, p)) > 0)
+        if ((length += k) == capacity - 1)
+            out = realloc(out, capacity *= 2);
+    out[length] = '\0';
+
+    int s = pclose(p);
+    *status = WIFEXITED(s) ? WEXITSTATUS(s) : -1;
+    return out;
+}
+
+static void test_batch(const char *mazing, const char *path, gmp_randstate_t rand)
+{
+    const int w = 6, h = 4;
+    char command[4096];
+    int status;
+    mpz_t count, index;
+    mpz_init(count);
+    mpz_init(index);
+    fmc(&count, w, h);
+
+    /* The expected output, and the input with some blank lines and
+    an index that's out of range */
+    size_t expected_length = 0;
+    char *expected = 0;
+    FILE *in = fopen(path, "w");
+    if (!in)
+    {
+        perror(path);
+        exit(2);
+    }
+    for (int k = 0; k < NUM_INDICES; k++)
+    {
+        mpz_urandomm(index, rand, count);
+        gmp_fprintf(in, k % 3 ? "%Zd\n" : "\n  %Zd \n\n", index);
+        if (k == NUM_INDICES / 2)
+            gmp_fprintf(in, "%Zd\n", count);
+
+        gmp_snprintf(command, sizeof command, "'%s' %d %d %Zd", mazing, w, h, index);
+        char *one = run(command, &status);
+        if (status != 0)
+            fail("mazing W H i failed", w, h, index);
+        expected = realloc(expected, expected_length + strlen(one) + 1);
+        strcpy(expected + expected_length, one);
+        expected_length += strlen(one);
+        free(one);
+    }
+    fclose(in);
+
+    snprintf(command, sizeof command, "MAZING_THREADS=4 '%s' %d %d --batch '%s'", mazing, w, h, path);
+    char *batch = run(command, &status);
+    if (status != EX_DATAERR)
+    {
+        fprintf(stderr, "--batch exited with status %d, not %d\n", status, EX_DATAERR);
+        failures++;
+    }
+    if (!expected || strcmp(batch, expected) != 0)
+    {
+        fprintf(stderr, "--batch printed something different from one maze at a time\n");
+        failures++;
+    }
+
+    free(batch);
+    free(expected);
+    remove(path);
+    mpz_clear(count);
+    mpz_clear(index);
+}
+
+
+/** daemon: mazingd answers requests, and refuses the ones that are too big **/
+
+/* Connect to the server at 'path', giving it a few seconds to start up */
+static int daemon_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof addr.sun_path - 1);
+
+    for (int tries = 0; tries < 500; tries++)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof addr) == 0)
+            return fd;
+        if (fd >= 0) close(fd);
+
+        struct timespec pause = { 0, 10000000 };
+        nanosleep(&pause, 0);
+    }
+    return -1;
+}
+
+/* Send a request, and return the status of the response, or -1 if the
+connection failed. If the response is a number, it's stored in 'out'. */
+static int daemon_call(int fd, uint32_t op, uint32_t width, uint32_t height, mpz_t index, mpz_t out)
+{
+    mazingd_request_t req;
+    mazingd_response_t res;
+    size_t length = 0;
+    void *payload = index ? mazingd_export(index, &length) : 0;
+    req.op = op;
+    req.width = width;
+    req.height = height;
+    req.length = length;
+
+    int failed = mazingd_write_full(fd, &req, sizeof req) != 0
+        || (length && mazingd_write_full(fd, payload, length) != 0)
+        || mazingd_read_full(fd, &res, sizeof res) != 0
+        || res.length > MAZINGD_MAX_PAYLOAD;
+    free(payload);
+    if (failed)
+        return -1;
+
+    char *buf = malloc(res.length + 1);
+    failed = mazingd_read_full(fd, buf, res.length) != 0;
+    if (!failed && op != MAZINGD_UNRANK && op != MAZINGD_RENDER)
+        mazingd_import(out, buf, res.length);
+    free(buf);
+    return failed ? -1 : (int) res.status;
+}
+
+static void expect_status(int fd, uint32_t op, uint32_t width, uint32_t height, mpz_t index,
+    int expected)
+{
+    mpz_t out;
+    mpz_init(out);
+    int status = daemon_call(fd, op, width, height, index, out);
+    if (status != expected)
+    {
+        fprintf(stderr, "op %u on %ux%u: status %d, not %d\n", op, width, height, status, expected);
+        failures++;
+    }
+    mpz_clear(out);
+}
+
+static void expect_count(int fd, uint32_t width, uint32_t height)
+{
+    mpz_t count, answer;
+    mpz_init(count);
+    mpz_init(answer);
+    fmc(&count, width < height ? width : height, width < height ? height : width);
+
+    int status = daemon_call(fd, MAZINGD_COUNT, width, height, 0, answer);
+    if (status != MAZINGD_OK || mpz_cmp(answer, count) != 0)
+    {
+        gmp_fprintf(stderr, "count on %ux%u: status %d, count %Zd\n", width, height, status, answer);
+        failures++;
+    }
+
+    mpz_clear(count);
+    mpz_clear(answer);
+}
+
+static void test_daemon(const char *mazingd, const char *path)
+{
+    /* If the server dies, we want to say so, rather than die too */
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        execl(mazingd, mazingd, "-s", path, "-t", "2", (char *) 0);
+        perror(mazingd);
+        _exit(127);
+    }
+
+    int fd = daemon_connect(path);
+    if (fd < 0)
+    {
+        perror(path);
+        failures++;
+    }
+    else
+    {
+        mpz_t index;
+        mpz_init_set_ui(index, 12345);
+
+        expect_count(fd, 7, 5);
+        expect_count(fd, 5, 7);
+        expect_count(fd, 524288, 2);
+        expect_status(fd, MAZINGD_COUNT, 1024, 1024, 0, MAZINGD_BAD_REQUEST);
+        expect_status(fd, MAZINGD_COUNT, 65, 1024, 0, MAZINGD_BAD_REQUEST);
+        expect_status(fd, MAZINGD_COUNT, 2048, 512, 0, MAZINGD_BAD_REQUEST);
+        expect_status(fd, MAZINGD_COUNT, 1048577, 1, 0, MAZINGD_BAD_REQUEST);
+        expect_status(fd, MAZINGD_UNRANK, 7, 5, index, MAZINGD_OK);
+        expect_status(fd, MAZINGD_UNRANK, 1048576, 1, index, MAZINGD_BAD_REQUEST);
+
+        /* Make sure it's still there */
+        expect_count(fd, 3, 3);
+
+        mpz_clear(index);
+        close(fd);
+    }
+
+    int status;
+    kill(pid, SIGTERM);
+    waitpid(pid, &status, 0);
+}
+
+
+static void usage(char *argv0)
+{
+    fprintf(stderr, "Usage: %s rank\n", argv0);
+    fprintf(stderr, "       %s state file width height\n", argv0);
+    fprintf(stderr, "       %s store file\n", argv0);
+    fprintf(stderr, "       %s checkpoint file\n", argv0);
+    fprintf(stderr, "       %s batch mazing file\n", argv0);
+    fprintf(stderr, "       %s daemon mazingd socket\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+    gmp_randstate_t rand;
+    gmp_randinit_default(rand);
+    gmp_randseed_ui(rand, 1);
+
+    if (argc == 2 && strcmp(argv[1], "rank") == 0)
+        test_rank(rand);
+    else if (argc == 5 && strcmp(argv[1], "state") == 0)
+        test_state(argv[2], atoi(argv[3]), atoi(argv[4]), rand);
+    else if (argc == 3 && strcmp(argv[1], "store") == 0)
+        test_store(argv[2]);
+    else if (argc == 3 && strcmp(argv[1], "checkpoint") == 0)
+        test_checkpoint(argv[2], rand);
+    else if (argc == 4 && strcmp(argv[1], "batch") == 0)
+        test_batch(argv[2], argv[3], rand);
+    else if (argc == 4 && strcmp(argv[1], "daemon") == 0)
+        test_daemon(argv[2], argv[3]);
+    else
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    gmp_randclear(rand);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,33 @@
+/* timing.c - Clocks and percentiles */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <time.h>
+#include "timing.h"
+
+double mazing_timing_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int cmp_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+void mazing_timing_sort(double *t, int n)
+{
+    qsort(t, n, sizeof(double), cmp_doubles);
+}
+
+double mazing_timing_quantile(double *t, int n, double q)
+{
+    int rank = (int) (q * n + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > n) rank = n;
+    return t[rank - 1];
+}
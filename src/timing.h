@@ -0,0 +1,15 @@
+/* timing.h - Clocks and percentiles, for the library's progress
+reports and statistics and for the benchmark programs
+
+These are compiled into the library, so they have its mazing_ prefix,
+but they aren't part of its interface and this header isn't installed.
+*/
+
+/* Seconds on a monotonic clock, from some arbitrary starting point */
+double mazing_timing_now(void);
+
+/* Sort 'n' times into ascending order */
+void mazing_timing_sort(double *t, int n);
+
+/* The 'q'th quantile of the sorted array 't', by the nearest-rank method */
+double mazing_timing_quantile(double *t, int n, double q);